@@ -0,0 +1,122 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Measure the refresh rate the library reaches with the given flags.
+//
+// Each SwapOnVSync() returns after the next full refresh of the panel, so
+// counting them over a couple of seconds tells the refresh rate. Useful to
+// compare settings such as --led-pwm-bits, --led-scan-mode or
+// --led-row-addr-type; don't combine with --led-limit-refresh.
+//
+// This code is public domain
+// (but note, that the led-matrix library this depends on is GPL v2)
+
+#include "led-matrix.h"
+
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+using rgb_matrix::RGBMatrix;
+using rgb_matrix::FrameCanvas;
+
+volatile bool interrupt_received = false;
+static void InterruptHandler(int signo) {
+  interrupt_received = true;
+}
+
+static int usage(const char *progname) {
+  fprintf(stderr, "usage: %s [options]\n", progname);
+  fprintf(stderr, "Prints the average refresh rate in Hz.\n");
+  fprintf(stderr, "Options:\n");
+  fprintf(stderr,
+          "\t-s <seconds>     : Seconds to measure (Default: 10).\n"
+          "\t-w <seconds>     : Seconds warm-up before measuring (Default: 2).\n"
+          );
+  rgb_matrix::PrintMatrixFlags(stderr);
+  return 1;
+}
+
+static double GetTime() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// A pattern with all bitplanes in use, so that nothing is faster than usual.
+static void DrawPattern(FrameCanvas *canvas, int offset) {
+  for (int y = 0; y < canvas->height(); ++y) {
+    for (int x = 0; x < canvas->width(); ++x) {
+      canvas->SetPixel(x, y, (x + offset) * 7, (y + offset) * 11,
+                       (x + y) * 5);
+    }
+  }
+}
+
+// Swap until "seconds" passed; returns the number of swaps.
+static int CountSwaps(RGBMatrix *matrix, FrameCanvas **offscreen,
+                      double seconds) {
+  int swaps = 0;
+  const double end = GetTime() + seconds;
+  while (!interrupt_received && GetTime() < end) {
+    *offscreen = matrix->SwapOnVSync(*offscreen);
+    ++swaps;
+  }
+  return swaps;
+}
+
+int main(int argc, char *argv[]) {
+  RGBMatrix::Options matrix_options;
+  rgb_matrix::RuntimeOptions runtime_opt;
+  if (!rgb_matrix::ParseOptionsFromFlags(&argc, &argv,
+                                         &matrix_options, &runtime_opt)) {
+    return usage(argv[0]);
+  }
+
+  double seconds = 10;
+  double warmup = 2;
+  int opt;
+  while ((opt = getopt(argc, argv, "s:w:")) != -1) {
+    switch (opt) {
+    case 's': seconds = atof(optarg); break;
+    case 'w': warmup = atof(optarg); break;
+    default:
+      return usage(argv[0]);
+    }
+  }
+  if (seconds <= 0 || warmup < 0) {
+    fprintf(stderr, "Seconds to measure need to be positive.\n");
+    return usage(argv[0]);
+  }
+
+  RGBMatrix *matrix = RGBMatrix::CreateFromOptions(matrix_options, runtime_opt);
+  if (matrix == NULL)
+    return 1;
+
+  signal(SIGTERM, InterruptHandler);
+  signal(SIGINT, InterruptHandler);
+
+  // Two canvases with the same pattern, slightly shifted, so that swapping
+  // shows that we're running.
+  FrameCanvas *offscreen = matrix->CreateFrameCanvas();
+  DrawPattern(offscreen, 0);
+  offscreen = matrix->SwapOnVSync(offscreen);
+  DrawPattern(offscreen, 1);
+
+  CountSwaps(matrix, &offscreen, warmup);
+
+  const double start = GetTime();
+  const int swaps = CountSwaps(matrix, &offscreen, seconds);
+  const double duration = GetTime() - start;
+
+  if (swaps > 0 && duration > 0) {
+    printf("%dx%d, pwm-bits=%d: %d frames in %.2fs: %.1fHz (%.1fusec/frame)\n",
+           matrix->width(), matrix->height(), matrix->pwmbits(),
+           swaps, duration, swaps / duration, 1e6 * duration / swaps);
+  }
+
+  matrix->Clear();
+  delete matrix;
+
+  return 0;
+}
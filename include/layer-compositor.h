@@ -0,0 +1,156 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//
+// Composite a stack of RGBA layers, e.g. a clock and alerts on top of video,
+// into a FrameCanvas.
+//
+// Each layer is a canvas of its own with a position, an opacity and a
+// visibility. Layers remember which of their pixels changed, so compositing
+// only blends the areas that changed since the last time; layers that don't
+// change don't cost anything per frame.
+
+#ifndef RPI_LAYER_COMPOSITOR_H
+#define RPI_LAYER_COMPOSITOR_H
+
+#include <stdint.h>
+
+#include <map>
+#include <vector>
+
+#include "canvas.h"
+#include "graphics.h"
+
+namespace rgb_matrix {
+class FrameCanvas;
+class LayerCompositor;
+
+// Color with alpha; r, g and b are premultiplied, i.e. already scaled by
+// a / 255, so they are never larger than a.
+struct PremultipliedColor {
+  uint8_t r;
+  uint8_t g;
+  uint8_t b;
+  uint8_t a;
+};
+
+// A layer of the LayerCompositor. Created and owned by it.
+// Drawing with the Canvas interface, e.g. with DrawText(), sets opaque
+// pixels; Clear() makes the layer fully transparent.
+class Layer : public Canvas {
+public:
+  // Set pixel with a "alpha" of 0 (transparent) .. 255 (opaque); the color
+  // is not premultiplied.
+  void SetPixelRGBA(int x, int y, uint8_t red, uint8_t green, uint8_t blue,
+                    uint8_t alpha);
+
+  // Set a "width" x "height" block of opaque pixels starting at x, y from
+  // "colors", row by row; e.g. to put a decoded video frame into a layer.
+  void SetPixels(int x, int y, int width, int height, const Color *colors);
+
+  // Same with premultiplied colors.
+  void SetPixels(int x, int y, int width, int height,
+                 const PremultipliedColor *colors);
+
+  // Position of the top left corner of this layer on the canvas; parts
+  // outside the canvas are not shown. Initially 0, 0.
+  void SetPosition(int x, int y);
+  int x() const { return x_; }
+  int y() const { return y_; }
+
+  // The whole layer is multiplied with this, 0 .. 255 (default).
+  void SetOpacity(uint8_t opacity);
+  uint8_t opacity() const { return opacity_; }
+
+  // An invisible layer is not composited at all. Layers are visible by
+  // default.
+  void SetVisible(bool visible);
+  bool visible() const { return visible_; }
+
+  // -- Canvas interface.
+  virtual int width() const { return width_; }
+  virtual int height() const { return height_; }
+  virtual void SetPixel(int x, int y,
+                        uint8_t red, uint8_t green, uint8_t blue);
+  virtual void Clear();
+  virtual void Fill(uint8_t red, uint8_t green, uint8_t blue);
+
+private:
+  friend class LayerCompositor;
+
+  Layer(LayerCompositor *compositor, int width, int height);
+  virtual ~Layer() {}
+
+  // Layer pixels in the range changed.
+  void MarkDirty(int x, int y, int width, int height) {
+    dirty_x0_ = x < dirty_x0_ ? x : dirty_x0_;
+    dirty_y0_ = y < dirty_y0_ ? y : dirty_y0_;
+    dirty_x1_ = x + width > dirty_x1_ ? x + width : dirty_x1_;
+    dirty_y1_ = y + height > dirty_y1_ ? y + height : dirty_y1_;
+  }
+  bool dirty() const { return dirty_x0_ < dirty_x1_; }
+
+  LayerCompositor *const compositor_;
+  const int width_;
+  const int height_;
+  std::vector<PremultipliedColor> pixels_;
+  int x_, y_;
+  uint8_t opacity_;
+  bool visible_;
+  int dirty_x0_, dirty_y0_, dirty_x1_, dirty_y1_;  // Empty: x0 >= x1
+};
+
+class LayerCompositor {
+public:
+  // A compositor for canvases of the given size, e.g. of the RGBMatrix.
+  LayerCompositor(int width, int height);
+  ~LayerCompositor();
+
+  // Create a new layer of the given size on top of all others. It is fully
+  // transparent and owned by the compositor.
+  Layer *AddLayer(int width, int height);
+
+  // Remove a layer and delete it.
+  void RemoveLayer(Layer *layer);
+
+  // Composite the layers, bottom to top over black, into the canvas.
+  // Only the pixels that changed since this canvas was rendered to last time
+  // are written; a canvas not seen before gets everything. So this works
+  // with canvases that are passed back and forth with SwapOnVSync(), but
+  // everything else drawn on them is overwritten only where layers changed.
+  void Render(FrameCanvas *canvas);
+
+  // Forget about this canvas, e.g. before it is drawn on otherwise. Not
+  // needed for canvases handed back with ReleaseFrameCanvas(); a canvas
+  // created again from them gets everything.
+  void ForgetCanvas(FrameCanvas *canvas);
+
+private:
+  friend class Layer;
+
+  struct Span {
+    int x0, x1;   // Empty: x0 >= x1
+  };
+
+  // Canvas area changed, e.g. as a layer moved.
+  void MarkDirty(int x, int y, int width, int height);
+  void MarkLayerArea(const Layer *layer);
+
+  // Blend the layers for row "y" from x0 to x1 into composited_.
+  void CompositeRow(int y, int x0, int x1);
+
+  const int width_;
+  const int height_;
+  std::vector<Layer*> layers_;            // Bottom to top.
+  std::vector<Span> dirty_;               // Per row, not composited yet.
+  std::vector<Color> composited_;
+  std::vector<PremultipliedColor> row_;   // Blend buffer.
+
+  // Per canvas the spans composited but not written to it yet.
+  struct Pending {
+    unsigned generation;            // FrameCanvas::generation() they are for.
+    std::vector<Span> rows;
+  };
+  std::map<FrameCanvas*, Pending> pending_;
+};
+
+}  // namespace rgb_matrix
+#endif  // RPI_LAYER_COMPOSITOR_H
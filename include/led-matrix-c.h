@@ -106,7 +106,7 @@ struct RGBLedMatrixOptions {
    */
   int brightness;
 
-  /* Scan mode: 0=progressive, 1=interlaced
+  /* Scan mode: 0=progressive, 1=interlaced, 2=bit-reversed
    * Corresponding flag: --led-scan-mode
    */
   int scan_mode;
@@ -158,6 +158,61 @@ struct RGBLedMatrixOptions {
    * processes when waiting and renders single core boards more responsive.
    */
   bool disable_busy_waiting;     /* Corresponding flag: --led-busy-waiting */
+
+  /* If > 0, off-screen canvases are drawn as plain RGB and only encoded
+   * when swapped in with led_matrix_swap_on_vsync(), using this many
+   * threads. 0 = encode each pixel when set.
+   */
+  int encode_threads;            /* Corresponding flag: --led-encode-threads */
+
+  /* Maximum number of PWM bits; up to 16. Default 11. pwm_bits can't be
+   * larger.
+   */
+  int max_pwm_bits;              /* Corresponding flag: --led-max-pwm-bits */
+
+  /* Don't clock out bitplanes of rows that have no pixel on; their pulse
+   * time is still waited for with the LEDs off, so the timing doesn't
+   * depend on the content. Saves clock-out time with mostly dark content.
+   * Not for inverse colors.
+   */
+  bool skip_empty_planes;        /* Corresponding flag: --led-skip-empty-planes */
+
+  /* Show consecutive bitplanes with the same content with one pulse; saves
+   * their clock-out time with flat colors on canvases shown with
+   * led_matrix_swap_on_vsync().
+   */
+  bool merge_identical_planes;   /* Corresponding flag: --led-merge-identical-planes */
+
+  /* Apply brightness when showing by shortening the pulses, so that
+   * led_matrix_set_brightness() takes effect immediately on all canvases.
+   */
+  bool brightness_at_output;     /* Corresponding flag: --led-brightness-at-output */
+
+  /* Back the canvas memory with transparent huge pages if available. */
+  bool huge_pages;               /* Corresponding flag: --led-huge-pages */
+
+  /* With pwm_bits below the bits allocated, dither the bits not shown
+   * instead of dropping them; led_canvas_set_spatial_dither() per canvas.
+   */
+  bool spatial_dither;           /* Corresponding flag: --led-spatial-dither */
+
+  /* Lowest bitplane shown in each refresh, one digit each, e.g. "0212";
+   * implies pwm_dither_bits.
+   */
+  const char *pwm_dither_sequence; /* Corresponding flag: --led-pwm-dither-sequence */
+
+  /* Show the longest bitplanes in 2^pwm_split_bits shorter pulses spread
+   * over the refresh; less flicker at the same refresh rate.
+   */
+  int pwm_split_bits;            /* Corresponding flag: --led-pwm-split-bits */
+
+  /* Row scan order overriding scan_mode: "stride:<n>" or a comma separated
+   * list of all rows lit at a time.
+   */
+  const char *scan_order;        /* Corresponding flag: --led-scan-order */
+
+  /* File with per panel or per pixel color gains to even out panels. */
+  const char *uniformity_file;   /* Corresponding flag: --led-uniformity-file */
 };
 
 /**
@@ -341,6 +396,14 @@ void led_canvas_fill(struct LedCanvas *canvas, uint8_t r, uint8_t g, uint8_t b);
  */
 struct LedCanvas *led_matrix_create_offscreen_canvas(struct RGBLedMatrix *matrix);
 
+/**
+ * Hand a canvas created with led_matrix_create_offscreen_canvas() back, to be
+ * re-used by the next call of it. Don't use the canvas afterwards.
+ * Returns false if it is currently shown or not from this matrix.
+ */
+bool led_matrix_release_offscreen_canvas(struct RGBLedMatrix *matrix,
+                                         struct LedCanvas *canvas);
+
 /**
  * Swap the given canvas (created with create_offscreen_canvas) with the
  * currently active canvas on vsync (blocks until vsync is reached).
@@ -356,6 +419,64 @@ struct LedCanvas *led_matrix_create_offscreen_canvas(struct RGBLedMatrix *matrix
 struct LedCanvas *led_matrix_swap_on_vsync(struct RGBLedMatrix *matrix,
                                            struct LedCanvas *canvas);
 
+/**
+ * Like led_matrix_swap_on_vsync(), but the returned canvas has the content
+ * of the one now shown, so only changes need to be drawn. Only what was
+ * drawn to since the last swap is copied.
+ */
+struct LedCanvas *led_matrix_swap_on_vsync_incremental(
+  struct RGBLedMatrix *matrix, struct LedCanvas *canvas);
+
+/**
+ * Like led_matrix_swap_on_vsync(), but the canvas is faded in over
+ * "duration_ms" milliseconds by alternating between the two canvases in
+ * the refresh. Returns when the fade is done.
+ */
+struct LedCanvas *led_matrix_crossfade_on_vsync(struct RGBLedMatrix *matrix,
+                                                struct LedCanvas *canvas,
+                                                int duration_ms);
+
+/**
+ * Store an off-screen canvas in a compact form to save memory, e.g. for
+ * many pre-rendered frames. It can still be swapped in; drawing on it
+ * unpacks it again. Returns false if this would not save memory.
+ */
+bool led_canvas_pack(struct LedCanvas *canvas);
+
+/**
+ * Move the content of the given region of the canvas by dx pixels to the
+ * right and dy pixels down (negative: left, up); pixels moved in are black.
+ * Use 0, 0 and the canvas size as region to scroll everything.
+ */
+void led_canvas_scroll(struct LedCanvas *canvas, int dx, int dy,
+                       int x, int y, int width, int height);
+
+/**
+ * Dither the bits below the PWM bits shown for pixels set from now on.
+ */
+void led_canvas_set_spatial_dither(struct LedCanvas *canvas, bool on);
+
+/**
+ * Keep an RGB copy of the pixels of this canvas, so that reading them back
+ * with led_canvas_get_pixel() is cheap and exact. Off by default.
+ */
+void led_canvas_set_rgb_shadow(struct LedCanvas *canvas, bool on);
+
+/**
+ * Get the color of a pixel; black outside the canvas. Without the RGB
+ * shadow, this is decoded from the internal representation: slower and only
+ * approximate with reduced brightness or pwm bits.
+ */
+void led_canvas_get_pixel(struct LedCanvas *canvas, int x, int y,
+                          uint8_t *red, uint8_t *green, uint8_t *blue);
+
+/**
+ * Get a width x height block of pixels starting at x, y, row by row;
+ * the counterpart of led_canvas_set_pixels().
+ */
+void led_canvas_get_pixels(struct LedCanvas *canvas, int x, int y,
+                           int width, int height, struct Color *colors);
+
 uint8_t led_matrix_get_brightness(struct RGBLedMatrix *matrix);
 void led_matrix_set_brightness(struct RGBLedMatrix *matrix, uint8_t brightness);
 
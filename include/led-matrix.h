@@ -110,7 +110,7 @@ public:
     // Flag: --led-brightness
     int brightness;
 
-    // Scan mode: 0=progressive, 1=interlaced.
+    // Scan mode: 0=progressive, 1=interlaced, 2=bit-reversed.
     // Flag: --led-scan-mode
     int scan_mode;
 
@@ -159,6 +159,74 @@ public:
     // Sleep instead of busy wait to free CPU cycles but get slightly less
     // accurate frame timing.
     bool disable_busy_waiting;   // Flag: --led-busy-waiting
+
+    // If > 0, off-screen FrameCanvases keep an RGB copy to draw into, which
+    // is only encoded into the internal representation when handed to
+    // SwapOnVSync(); using this many threads (none of them on the core
+    // the refresh runs on). This makes drawing with many SetPixel() calls
+    // a lot cheaper. 0 = encode each pixel when set (default).
+    int encode_threads;  // Flag: --led-encode-threads
+
+    // Maximum number of PWM bits that can be used; the frame buffers are
+    // sized for this many bitplanes, 16 at most. Only needed for more color
+    // depth in very low brightness settings (or to save memory with fewer).
+    // pwm_bits is limited to this value. Default: 11
+    // Flag: --led-max-pwm-bits
+    int max_pwm_bits;
+
+    // Don't clock out bitplanes of a row that have no pixel on; their pulse
+    // time is still waited for with the LEDs off, so the timing doesn't
+    // depend on the content. Saves clock-out time with mostly dark content.
+    // Not for inverse colors.
+    bool skip_empty_planes;  // Flag: --led-skip-empty-planes
+
+    // Consecutive bitplanes of a row with the same content are clocked out
+    // once and shown with one long pulse, which saves their clock-out time
+    // with flat colors. Only for canvases shown with SwapOnVSync().
+    bool merge_identical_planes;  // Flag: --led-merge-identical-planes
+
+    // Apply brightness when showing the canvases, by shortening the
+    // pulses each bitplane is shown, instead of when setting pixels.
+    // SetBrightness() then takes effect immediately for all canvases, also
+    // ones that are not redrawn. At low brightness, the least significant
+    // bitplanes are dropped.
+    bool brightness_at_output;  // Flag: --led-brightness-at-output
+
+    // Back the memory of the FrameCanvases with transparent huge pages
+    // if the kernel supports them; fewer TLB misses while refreshing.
+    bool huge_pages;  // Flag: --led-huge-pages
+
+    // With pwm_bits below the bits allocated, dither the bits that are not
+    // shown with an 8x8 ordered pattern instead of dropping them: smooth
+    // gradients at the refresh rate of fewer PWM bits. Default for all
+    // canvases; FrameCanvas::set_spatial_dither() changes it per canvas.
+    bool spatial_dither;  // Flag: --led-spatial-dither
+
+    // Temporal dithering with an explicit sequence: the lowest bitplane
+    // shown in each refresh, one digit per refresh and then starting over,
+    // e.g. "0212". Bitplanes up to the largest digit are shown with the
+    // shortest pulse, as with pwm_dither_bits, which is then implied.
+    // NULL: the sequence follows from pwm_dither_bits.
+    const char *pwm_dither_sequence;  // Flag: --led-pwm-dither-sequence
+
+    // Split the longest bitplanes into shorter pulses, spread over as many
+    // passes over all rows in each refresh: with 1, the MSB is shown in two
+    // halves, with 2 in four quarters and the next plane in two halves etc.
+    // Less flicker and camera banding at the same refresh rate, at the cost
+    // of clocking out these planes more often. 0..4, Default: 0
+    int pwm_split_bits;  // Flag: --led-pwm-split-bits
+
+    // Order in which the rows are scanned, overriding scan_mode:
+    // "stride:<n>" shows every n-th row, then starts again one row further;
+    // or a comma separated list of all rows 0..rows/2-1 (rows that are lit
+    // at the same time count once). NULL: scan_mode decides.
+    const char *scan_order;  // Flag: --led-scan-order
+
+    // File with color gains that even out panels (or pixels) differing in
+    // brightness or white point; see README. The correction is compiled
+    // into per-profile color tables, so it costs no extra math per pixel.
+    // NULL: no correction.
+    const char *uniformity_file;  // Flag: --led-uniformity-file
   };
 
   // Factory to create a matrix. Additional functionality includes dropping
@@ -217,9 +285,18 @@ public:
   // The ownership of the created Canvases remains with the RGBMatrix, so you
   // don't have to worry about deleting them (but you also don't want to create
   // more than needed as this will fill up your memory as they are only deleted
-  // when the RGBMatrix is deleted).
+  // when the RGBMatrix is deleted). Canvases only needed for a while can
+  // be handed back with ReleaseFrameCanvas().
+  //
+  // A canvas re-used from the released ones is cleared and has the current
+  // pwm bits, brightness and luminance correction, as a new one would.
   FrameCanvas *CreateFrameCanvas();
 
+  // Give a canvas created with CreateFrameCanvas() back to be re-used by
+  // the next CreateFrameCanvas() call. It must not be used afterwards.
+  // Returns false if the canvas is currently shown or not one of ours.
+  bool ReleaseFrameCanvas(FrameCanvas *canvas);
+
   // This method waits to the next VSync and swaps the active buffer with the
   // supplied buffer. The formerly active buffer is returned.
   //
@@ -238,6 +315,25 @@ public:
   // time-correct animations.
   FrameCanvas *SwapOnVSync(FrameCanvas *other, unsigned framerate_fraction = 1);
 
+  // Like SwapOnVSync(), but the returned buffer is brought up to date with
+  // "other", which is now shown; so you only need to draw what changes
+  // for the next frame instead of everything.
+  //
+  // The canvases keep track of the pixels drawn to, so as long as you
+  // swap the same pair with this method, only these are copied; cheap if
+  // little changes, like the digits of a clock. Clear(), Fill() and
+  // Deserialize() count as change of everything.
+  FrameCanvas *SwapOnVSyncIncremental(FrameCanvas *other,
+                                      unsigned framerate_fraction = 1);
+
+  // Like SwapOnVSync(), but "other" is faded in over "duration_ms"
+  // milliseconds: the refresh shows it in a growing share of the refresh
+  // cycles and the active buffer in the others, so no intermediate frames
+  // need to be drawn. Returns once the fade is done; neither buffer must be
+  // drawn on until then. Works best with a high refresh rate; a steady one,
+  // as with Options::limit_refresh_rate_hz, avoids flicker.
+  FrameCanvas *CrossfadeOnVSync(FrameCanvas *other, int duration_ms);
+
   // -- Setting shape and behavior of matrix.
 
   // Apply a pixel mapper. This is used to re-map pixels according to some
@@ -254,7 +350,8 @@ public:
   // limited comic-colors, 1 might be sufficient. Lower require less CPU and
   // increases refresh-rate.
   //
-  // Returns boolean to signify if value was within range.
+  // Returns boolean to signify if value was within range. Values above
+  // Options::max_pwm_bits are limited to it (and return false).
   //
   // This sets the PWM bits for the current active FrameCanvas and future
   // ones that are created with CreateFrameCanvas().
@@ -266,7 +363,8 @@ public:
   bool luminance_correct() const;
 
   // Set brightness in percent for all created FrameCanvas. 1%..100%.
-  // This will only affect newly set pixels.
+  // This will only affect newly set pixels, unless
+  // Options::brightness_at_output is set, then it applies immediately.
   void SetBrightness(uint8_t brightness);
   uint8_t brightness();
 
@@ -342,7 +440,8 @@ public:
   // Set PWM bits used for this Frame.
   // Simple comic-colors, 1 might be sufficient (111 RGB, i.e. 8 colors).
   // Lower require less CPU.
-  // Returns boolean to signify if value was within range.
+  // Returns boolean to signify if value was within range. Values above
+  // Options::max_pwm_bits are limited to it (and return false).
   bool SetPWMBits(uint8_t value);
   uint8_t pwmbits();
 
@@ -353,6 +452,11 @@ public:
   void SetBrightness(uint8_t brightness);
   uint8_t brightness();
 
+  // Dither the bits below the PWM bits shown (see
+  // Options::spatial_dither). Only affects newly set pixels.
+  void set_spatial_dither(bool on);
+  bool spatial_dither() const;
+
   //-- Serialize()/Deserialize() are fast ways to store and re-create a canvas.
 
   // Provides a pointer to a buffer of the internal representation to
@@ -377,6 +481,56 @@ public:
   // Copy content from other FrameCanvas owned by the same RGBMatrix.
   void CopyFrom(const FrameCanvas &other);
 
+  // Store this canvas in a compact form that only keeps the color bits of
+  // the parallel chains in use; 4x smaller with one chain, 2x with two (8x
+  // and 4x with wide GPIO). Useful for many pre-rendered frames.
+  // A packed canvas can be shown with SwapOnVSync(), copied from and
+  // serialized (which then gives the packed form, that Deserialize() also
+  // accepts). Drawing on it unpacks it again.
+  // Returns 'false' if this would not save memory (with more chains).
+  bool Pack();
+
+  //-- Reading back pixels, e.g. for effects that modify what is there.
+
+  // Keep an RGB copy of the pixels along with the internal representation,
+  // so that reading them back is cheap and gives exactly the colors set.
+  // Costs 3 bytes per pixel and a bit of time for each pixel set.
+  // Off by default; with Options::encode_threads, there always is one.
+  // On by default with Options::uniformity_file, as Scroll() then sets the
+  // moved pixels again; without it, they lose color depth.
+  void set_rgb_shadow(bool on);
+  bool rgb_shadow() const;
+
+  // Get the color of a pixel; black outside the canvas. Without the RGB
+  // shadow, it is decoded from the internal representation, which is a lot
+  // slower and only approximate with reduced brightness or pwm bits.
+  void GetPixel(int x, int y, uint8_t *red, uint8_t *green, uint8_t *blue);
+
+  // Get a "width" x "height" block of pixels starting at x, y into "colors",
+  // row by row; the counterpart of SetPixels().
+  void GetPixels(int x, int y, int width, int height, Color *colors);
+
+  // Set the pixels at the given "offsets" (y * width() + x) all to the same
+  // color. Cheaper than SetPixel() for each, as the color is only prepared
+  // once; e.g. for all pixels using one entry of a palette.
+  void SetPixelsToColor(const int *offsets, int count,
+                        uint8_t red, uint8_t green, uint8_t blue);
+
+  // Move the content of the canvas by dx pixels to the right and dy pixels
+  // down (negative: left or up). The pixels moved in are black, so for
+  // scrolling text or images only these need to be drawn.
+  // This works on the internal representation, so it is a lot cheaper than
+  // drawing everything again.
+  void Scroll(int dx, int dy);
+
+  // Same, but only moves the content within the given region.
+  void Scroll(int dx, int dy, int x, int y, int width, int height);
+
+  // Changes each time CreateFrameCanvas() hands out this canvas again after
+  // ReleaseFrameCanvas(). Helpers that remember what they drew on a canvas,
+  // such as the LayerCompositor, use it to tell that it starts over.
+  unsigned generation() const { return generation_; }
+
   // -- Canvas interface.
   virtual int width() const;
   virtual int height() const;
@@ -390,11 +544,12 @@ public:
 private:
   friend class RGBMatrix;
 
-  FrameCanvas(internal::Framebuffer *frame) : frame_(frame){}
+  FrameCanvas(internal::Framebuffer *frame) : frame_(frame), generation_(0) {}
   virtual ~FrameCanvas();   // Any FrameCanvas is owned by RGBMatrix.
   internal::Framebuffer *framebuffer() { return frame_; }
 
   internal::Framebuffer *const frame_;
+  unsigned generation_;
 };
 
 // Runtime options to simplify doing common things for many programs such as
@@ -0,0 +1,115 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//
+// A canvas of 8 bit palette indices that is rendered into a FrameCanvas.
+//
+// Effects that change colors, not geometry, such as color cycling or
+// switching the theme of a UI, only change palette entries. Rendering then
+// only touches the pixels that use a changed entry instead of everything.
+
+#ifndef RPI_PALETTE_CANVAS_H
+#define RPI_PALETTE_CANVAS_H
+
+#include <stdint.h>
+
+#include <bitset>
+#include <map>
+#include <vector>
+
+#include "graphics.h"
+
+namespace rgb_matrix {
+class FrameCanvas;
+
+class PaletteCanvas {
+public:
+  // A canvas of the given size, typically that of the RGBMatrix. All pixels
+  // have index 0, all palette entries are black.
+  PaletteCanvas(int width, int height);
+
+  int width() const { return width_; }
+  int height() const { return height_; }
+
+  // Set pixel to palette "index".
+  void SetPixel(int x, int y, uint8_t index);
+  uint8_t GetPixel(int x, int y) const;
+
+  // Set a "width" x "height" block of pixels starting at x, y from
+  // "indices", row by row.
+  void SetPixels(int x, int y, int width, int height, const uint8_t *indices);
+
+  // Set all pixels to "index".
+  void Fill(uint8_t index);
+
+  // Change the color of palette entry "index".
+  void SetColor(uint8_t index, uint8_t red, uint8_t green, uint8_t blue);
+  const Color &color(uint8_t index) const { return palette_[index]; }
+
+  // Rotate the palette entries first..last (inclusive) by "steps": entry
+  // first + steps gets the color of first and so on; negative steps go the
+  // other way. This is classic color cycling. Only cheap if the cycled
+  // entries cover a smaller part of the canvas, see Render().
+  void CycleColors(uint8_t first, uint8_t last, int steps = 1);
+
+  // Bring the canvas up to date with the pixels and colors.
+  // Only pixels changed since this canvas was rendered to last time are
+  // written, so this works with canvases that are passed back and forth with
+  // SwapOnVSync(); a canvas not seen before gets everything.
+  // Changed palette entries used by more than 1/8 of the pixels render all
+  // rows instead, as writing that many pixels one by one is slower; so
+  // full-screen color cycling costs as much as a full redraw.
+  void Render(FrameCanvas *canvas);
+
+  // Forget about this canvas, e.g. before it is drawn on otherwise. Not
+  // needed for canvases handed back with ReleaseFrameCanvas(); a canvas
+  // created again from them gets everything.
+  void ForgetCanvas(FrameCanvas *canvas);
+
+private:
+  struct Span {
+    int x0, x1;   // Empty: x0 >= x1
+  };
+
+  // What is not written to a canvas yet.
+  struct Pending {
+    unsigned generation;            // FrameCanvas::generation() it is for.
+    std::vector<Span> rows;         // Pixels with a new index.
+    std::bitset<256> colors;        // Palette entries with a new color.
+  };
+
+  void MarkDirty(int x, int y, int width, int height);
+
+  // Sort the pixel offsets by index, if indices changed since last time.
+  void UpdatePixelsByIndex();
+
+  // Offsets of this canvas, y * width_ + x, as offsets of "canvas", which
+  // has another width, into canvas_offsets_; pixels outside are dropped.
+  // Returns their number.
+  int ToCanvasOffsets(const FrameCanvas *canvas, const int *offsets,
+                      int count);
+
+  // Write the pixels of a row span with their current colors.
+  void RenderSpan(FrameCanvas *canvas, int y, int x0, int x1);
+
+  const int width_;
+  const int height_;
+  std::vector<uint8_t> indices_;
+  Color palette_[256];
+
+  // Changes not handed to the pending canvases yet.
+  std::vector<Span> dirty_;
+  std::bitset<256> changed_colors_;
+  bool any_dirty_;
+
+  // The offsets (y * width + x) of all pixels, ordered by index; the pixels
+  // with index i are from index_start_[i] to index_start_[i + 1].
+  std::vector<int> pixels_by_index_;
+  int index_start_[257];
+  bool pixels_by_index_valid_;
+
+  std::vector<Color> row_;        // Colors of one row for rendering.
+  std::vector<int> canvas_offsets_;  // See ToCanvasOffsets().
+  std::map<FrameCanvas*, Pending> pending_;
+};
+
+}  // namespace rgb_matrix
+#endif  // RPI_PALETTE_CANVAS_H
@@ -61,6 +61,7 @@ public:
   // While not technically necessary, one would expect that the number of
   // pixels stay the same, so
   // matrix_width * matrix_height == (*visible_width) * (*visible_height);
+  // unless the mapper maps one to many (see MapMatrixToVisible()).
   //
   // Returns boolean "true" if the mapping can be successfully done with this
   // mapper.
@@ -80,6 +81,21 @@ public:
   virtual void MapVisibleToMatrix(int matrix_width, int matrix_height,
                                   int visible_x, int visible_y,
                                   int *matrix_x, int *matrix_y) const = 0;
+
+  // Mappers that show a visible pixel on several matrix pixels, e.g. the
+  // same content on both faces of a sign or scaled up, return true here.
+  // The mapping is then done with MapMatrixToVisible() instead, and
+  // drawing a pixel sets all matrix pixels it is shown on.
+  virtual bool MapsOneToMany() const { return false; }
+
+  // For mappers that map one to many: the visible pixel that matrix pixel
+  // (matrix_x, matrix_y) shows. Returns false if it shows none (it stays
+  // dark). Called for each matrix pixel.
+  virtual bool MapMatrixToVisible(int matrix_width, int matrix_height,
+                                  int matrix_x, int matrix_y,
+                                  int *visible_x, int *visible_y) const {
+    return false;
+  }
 };
 
 // This is a place to register PixelMappers globally. If you register your
@@ -0,0 +1,105 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//
+// Kernels that encode mapped color values into the bitplane representation
+// of the Framebuffer.
+#ifndef RPI_RGBMATRIX_BITPLANE_ENCODER_INTERNAL_H
+#define RPI_RGBMATRIX_BITPLANE_ENCODER_INTERNAL_H
+
+#include <stdint.h>
+
+#include <atomic>
+#include <functional>
+#include <vector>
+
+#include "gpio-bits.h"
+#include "thread.h"
+
+namespace rgb_matrix {
+namespace internal {
+
+// Encode a run of "count" pixels whose bitplane words are consecutive and
+// that all use the same r/g/b gpio bits (this is the common case for pixels
+// next to each other in a row).
+//
+// "words" points to the word of the first pixel in bitplane 0, bitplane "b"
+// is found "plane_stride" words further for each b. The mapped color values
+// "red", "green" and "blue" have one bit per bitplane; only the bitplanes in
+// the range [first_plane, end_plane) are written. Bits of each word outside
+// of r_bit | g_bit | b_bit are left untouched.
+//
+// This is a bit-matrix transpose from per-pixel values to per-bitplane
+// words, which is what the vectorized implementations are for.
+typedef void (*EncodeRunFunction)(gpio_bits_t *words, int plane_stride,
+                                  int first_plane, int end_plane,
+                                  const uint16_t *red, const uint16_t *green,
+                                  const uint16_t *blue, int count,
+                                  gpio_bits_t r_bit, gpio_bits_t g_bit,
+                                  gpio_bits_t b_bit);
+
+struct EncodeKernel {
+  const char *name;
+  EncodeRunFunction encode_run;
+};
+
+// Kernel that is the fastest on this CPU. Chosen once at first call.
+const EncodeKernel &GetEncodeKernel();
+
+// All kernels that can run on this CPU, the portable "scalar" kernel first.
+// All of them produce byte-identical output; this is mostly useful to
+// compare them against each other.
+const std::vector<EncodeKernel> &GetAvailableEncodeKernels();
+
+// Encode a single pixel without branches; used for pixels that are not part
+// of a run.
+inline void EncodePixel(gpio_bits_t *word, int plane_stride,
+                        int first_plane, int end_plane,
+                        uint16_t red, uint16_t green, uint16_t blue,
+                        gpio_bits_t r_bit, gpio_bits_t g_bit, gpio_bits_t b_bit,
+                        gpio_bits_t keep_mask) {
+  word += first_plane * plane_stride;
+  for (int b = first_plane; b < end_plane; ++b) {
+    const gpio_bits_t color_bits
+      = ((gpio_bits_t) -((red >> b) & 1) & r_bit)
+      | ((gpio_bits_t) -((green >> b) & 1) & g_bit)
+      | ((gpio_bits_t) -((blue >> b) & 1) & b_bit);
+    *word = (*word & keep_mask) | color_bits;
+    word += plane_stride;
+  }
+}
+
+// A fixed set of worker threads to encode a whole frame in parallel. The
+// calling thread takes part in the work as well, so a pool created with
+// "threads" has threads - 1 workers.
+class EncodeWorkerPool {
+public:
+  // The worker threads are only allowed to run on the CPUs in
+  // "cpu_affinity_mask" (0: no restriction).
+  EncodeWorkerPool(int threads, uint32_t cpu_affinity_mask);
+  ~EncodeWorkerPool();
+
+  // Call "job" for each index in [0, count) and return once all are done.
+  // Jobs for different indices must not touch the same data.
+  void ParallelFor(int count, const std::function<void(int)> &job);
+
+private:
+  class Worker;
+
+  void RunJobs();
+
+  std::vector<Worker*> workers_;
+
+  Mutex mutex_;
+  pthread_cond_t work_available_;
+  pthread_cond_t work_done_;
+  unsigned generation_;  // Incremented with each ParallelFor().
+  int busy_workers_;
+  bool shutdown_;
+
+  const std::function<void(int)> *job_;
+  int job_count_;
+  std::atomic<int> next_index_;
+};
+
+}  // namespace internal
+}  // namespace rgb_matrix
+#endif  // RPI_RGBMATRIX_BITPLANE_ENCODER_INTERNAL_H
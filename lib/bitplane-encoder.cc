@@ -0,0 +1,305 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//
+// Scalar and vectorized implementations of the bitplane run encoder. The
+// vectorized versions are chosen at runtime depending on what the CPU
+// supports; all of them produce exactly the same output as the scalar one.
+
+#include "bitplane-encoder-internal.h"
+
+#if !defined(ENABLE_WIDE_GPIO_COMPUTE_MODULE)
+#  if defined(__x86_64__) || defined(__i386__)
+#    define BITPLANE_ENCODER_X86 1
+#    include <immintrin.h>
+#  elif defined(__ARM_NEON) || defined(__aarch64__)
+#    define BITPLANE_ENCODER_NEON 1
+#    include <arm_neon.h>
+#  endif
+#endif
+
+namespace rgb_matrix {
+namespace internal {
+namespace {
+
+void EncodeRunScalar(gpio_bits_t *words, int plane_stride,
+                     int first_plane, int end_plane,
+                     const uint16_t *red, const uint16_t *green,
+                     const uint16_t *blue, int count,
+                     gpio_bits_t r_bit, gpio_bits_t g_bit, gpio_bits_t b_bit) {
+  const gpio_bits_t keep_mask = ~(r_bit | g_bit | b_bit);
+  for (int i = 0; i < count; ++i) {
+    EncodePixel(words + i, plane_stride, first_plane, end_plane,
+                red[i], green[i], blue[i], r_bit, g_bit, b_bit, keep_mask);
+  }
+}
+
+#if BITPLANE_ENCODER_X86
+// Eight pixels at a time: the color values are tested per bitplane in 16 bit
+// lanes, the resulting all-ones/all-zero lanes are widened to full gpio words
+// and used to select the color bits.
+__attribute__((target("sse2")))
+void EncodeRunSSE2(gpio_bits_t *words, int plane_stride,
+                   int first_plane, int end_plane,
+                   const uint16_t *red, const uint16_t *green,
+                   const uint16_t *blue, int count,
+                   gpio_bits_t r_bit, gpio_bits_t g_bit, gpio_bits_t b_bit) {
+  const __m128i r_bits = _mm_set1_epi32(r_bit);
+  const __m128i g_bits = _mm_set1_epi32(g_bit);
+  const __m128i b_bits = _mm_set1_epi32(b_bit);
+  const __m128i keep = _mm_set1_epi32(~(r_bit | g_bit | b_bit));
+  int i = 0;
+  for (/**/; i + 8 <= count; i += 8) {
+    const __m128i r = _mm_loadu_si128((const __m128i*)(red + i));
+    const __m128i g = _mm_loadu_si128((const __m128i*)(green + i));
+    const __m128i b = _mm_loadu_si128((const __m128i*)(blue + i));
+    gpio_bits_t *plane_words = words + i + first_plane * plane_stride;
+    for (int p = first_plane; p < end_plane; ++p) {
+      const __m128i bit = _mm_set1_epi16((short)(1 << p));
+      const __m128i r_on = _mm_cmpeq_epi16(_mm_and_si128(r, bit), bit);
+      const __m128i g_on = _mm_cmpeq_epi16(_mm_and_si128(g, bit), bit);
+      const __m128i b_on = _mm_cmpeq_epi16(_mm_and_si128(b, bit), bit);
+      const __m128i color_lo = _mm_or_si128(
+        _mm_or_si128(_mm_and_si128(_mm_unpacklo_epi16(r_on, r_on), r_bits),
+                     _mm_and_si128(_mm_unpacklo_epi16(g_on, g_on), g_bits)),
+        _mm_and_si128(_mm_unpacklo_epi16(b_on, b_on), b_bits));
+      const __m128i color_hi = _mm_or_si128(
+        _mm_or_si128(_mm_and_si128(_mm_unpackhi_epi16(r_on, r_on), r_bits),
+                     _mm_and_si128(_mm_unpackhi_epi16(g_on, g_on), g_bits)),
+        _mm_and_si128(_mm_unpackhi_epi16(b_on, b_on), b_bits));
+      __m128i *const out = (__m128i*)plane_words;
+      _mm_storeu_si128(out, _mm_or_si128(
+                         _mm_and_si128(_mm_loadu_si128(out), keep), color_lo));
+      _mm_storeu_si128(out + 1, _mm_or_si128(
+                         _mm_and_si128(_mm_loadu_si128(out + 1), keep),
+                         color_hi));
+      plane_words += plane_stride;
+    }
+  }
+  EncodeRunScalar(words + i, plane_stride, first_plane, end_plane,
+                  red + i, green + i, blue + i, count - i,
+                  r_bit, g_bit, b_bit);
+}
+
+// Same as the SSE2 version, but sixteen pixels at a time.
+__attribute__((target("avx2")))
+void EncodeRunAVX2(gpio_bits_t *words, int plane_stride,
+                   int first_plane, int end_plane,
+                   const uint16_t *red, const uint16_t *green,
+                   const uint16_t *blue, int count,
+                   gpio_bits_t r_bit, gpio_bits_t g_bit, gpio_bits_t b_bit) {
+  const __m256i r_bits = _mm256_set1_epi32(r_bit);
+  const __m256i g_bits = _mm256_set1_epi32(g_bit);
+  const __m256i b_bits = _mm256_set1_epi32(b_bit);
+  const __m256i keep = _mm256_set1_epi32(~(r_bit | g_bit | b_bit));
+  int i = 0;
+  for (/**/; i + 16 <= count; i += 16) {
+    const __m256i r = _mm256_loadu_si256((const __m256i*)(red + i));
+    const __m256i g = _mm256_loadu_si256((const __m256i*)(green + i));
+    const __m256i b = _mm256_loadu_si256((const __m256i*)(blue + i));
+    gpio_bits_t *plane_words = words + i + first_plane * plane_stride;
+    for (int p = first_plane; p < end_plane; ++p) {
+      const __m256i bit = _mm256_set1_epi16((short)(1 << p));
+      const __m256i r_on = _mm256_cmpeq_epi16(_mm256_and_si256(r, bit), bit);
+      const __m256i g_on = _mm256_cmpeq_epi16(_mm256_and_si256(g, bit), bit);
+      const __m256i b_on = _mm256_cmpeq_epi16(_mm256_and_si256(b, bit), bit);
+      const __m256i color_lo = _mm256_or_si256(
+        _mm256_or_si256(
+          _mm256_and_si256(
+            _mm256_cvtepi16_epi32(_mm256_castsi256_si128(r_on)), r_bits),
+          _mm256_and_si256(
+            _mm256_cvtepi16_epi32(_mm256_castsi256_si128(g_on)), g_bits)),
+        _mm256_and_si256(
+          _mm256_cvtepi16_epi32(_mm256_castsi256_si128(b_on)), b_bits));
+      const __m256i color_hi = _mm256_or_si256(
+        _mm256_or_si256(
+          _mm256_and_si256(
+            _mm256_cvtepi16_epi32(_mm256_extracti128_si256(r_on, 1)), r_bits),
+          _mm256_and_si256(
+            _mm256_cvtepi16_epi32(_mm256_extracti128_si256(g_on, 1)), g_bits)),
+        _mm256_and_si256(
+          _mm256_cvtepi16_epi32(_mm256_extracti128_si256(b_on, 1)), b_bits));
+      __m256i *const out = (__m256i*)plane_words;
+      _mm256_storeu_si256(out, _mm256_or_si256(
+                            _mm256_and_si256(_mm256_loadu_si256(out), keep),
+                            color_lo));
+      _mm256_storeu_si256(out + 1, _mm256_or_si256(
+                            _mm256_and_si256(_mm256_loadu_si256(out + 1), keep),
+                            color_hi));
+      plane_words += plane_stride;
+    }
+  }
+  EncodeRunSSE2(words + i, plane_stride, first_plane, end_plane,
+                red + i, green + i, blue + i, count - i,
+                r_bit, g_bit, b_bit);
+}
+#endif  // BITPLANE_ENCODER_X86
+
+#if BITPLANE_ENCODER_NEON
+// Eight pixels at a time; vtst gives us all-ones lanes for set bits which are
+// sign-extended to full gpio words.
+void EncodeRunNEON(gpio_bits_t *words, int plane_stride,
+                   int first_plane, int end_plane,
+                   const uint16_t *red, const uint16_t *green,
+                   const uint16_t *blue, int count,
+                   gpio_bits_t r_bit, gpio_bits_t g_bit, gpio_bits_t b_bit) {
+  const uint32x4_t r_bits = vdupq_n_u32(r_bit);
+  const uint32x4_t g_bits = vdupq_n_u32(g_bit);
+  const uint32x4_t b_bits = vdupq_n_u32(b_bit);
+  const uint32x4_t keep = vdupq_n_u32(~(r_bit | g_bit | b_bit));
+  int i = 0;
+  for (/**/; i + 8 <= count; i += 8) {
+    const uint16x8_t r = vld1q_u16(red + i);
+    const uint16x8_t g = vld1q_u16(green + i);
+    const uint16x8_t b = vld1q_u16(blue + i);
+    gpio_bits_t *plane_words = words + i + first_plane * plane_stride;
+    for (int p = first_plane; p < end_plane; ++p) {
+      const uint16x8_t bit = vdupq_n_u16(1 << p);
+      const int16x8_t r_on = vreinterpretq_s16_u16(vtstq_u16(r, bit));
+      const int16x8_t g_on = vreinterpretq_s16_u16(vtstq_u16(g, bit));
+      const int16x8_t b_on = vreinterpretq_s16_u16(vtstq_u16(b, bit));
+      const uint32x4_t color_lo = vorrq_u32(
+        vorrq_u32(
+          vandq_u32(vreinterpretq_u32_s32(vmovl_s16(vget_low_s16(r_on))),
+                    r_bits),
+          vandq_u32(vreinterpretq_u32_s32(vmovl_s16(vget_low_s16(g_on))),
+                    g_bits)),
+        vandq_u32(vreinterpretq_u32_s32(vmovl_s16(vget_low_s16(b_on))),
+                  b_bits));
+      const uint32x4_t color_hi = vorrq_u32(
+        vorrq_u32(
+          vandq_u32(vreinterpretq_u32_s32(vmovl_s16(vget_high_s16(r_on))),
+                    r_bits),
+          vandq_u32(vreinterpretq_u32_s32(vmovl_s16(vget_high_s16(g_on))),
+                    g_bits)),
+        vandq_u32(vreinterpretq_u32_s32(vmovl_s16(vget_high_s16(b_on))),
+                  b_bits));
+      vst1q_u32(plane_words,
+                vorrq_u32(vandq_u32(vld1q_u32(plane_words), keep), color_lo));
+      vst1q_u32(plane_words + 4,
+                vorrq_u32(vandq_u32(vld1q_u32(plane_words + 4), keep),
+                          color_hi));
+      plane_words += plane_stride;
+    }
+  }
+  EncodeRunScalar(words + i, plane_stride, first_plane, end_plane,
+                  red + i, green + i, blue + i, count - i,
+                  r_bit, g_bit, b_bit);
+}
+#endif  // BITPLANE_ENCODER_NEON
+
+std::vector<EncodeKernel> CreateAvailableKernels() {
+  std::vector<EncodeKernel> result;
+  result.push_back({ "scalar", &EncodeRunScalar });
+#if BITPLANE_ENCODER_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse2")) {
+    result.push_back({ "sse2", &EncodeRunSSE2 });
+  }
+  if (__builtin_cpu_supports("sse2") && __builtin_cpu_supports("avx2")) {
+    result.push_back({ "avx2", &EncodeRunAVX2 });
+  }
+#endif
+#if BITPLANE_ENCODER_NEON
+  result.push_back({ "neon", &EncodeRunNEON });
+#endif
+  return result;
+}
+}  // anonymous namespace
+
+const std::vector<EncodeKernel> &GetAvailableEncodeKernels() {
+  static const std::vector<EncodeKernel> kernels = CreateAvailableKernels();
+  return kernels;
+}
+
+const EncodeKernel &GetEncodeKernel() {
+  // Kernels are sorted from slowest to fastest.
+  static const EncodeKernel &best = GetAvailableEncodeKernels().back();
+  return best;
+}
+
+class EncodeWorkerPool::Worker : public Thread {
+public:
+  Worker(EncodeWorkerPool *pool) : pool_(pool) {}
+
+  virtual void Run() {
+    unsigned seen_generation = 0;
+    for (;;) {
+      {
+        MutexLock l(&pool_->mutex_);
+        while (pool_->generation_ == seen_generation && !pool_->shutdown_) {
+          pool_->mutex_.WaitOn(&pool_->work_available_);
+        }
+        if (pool_->shutdown_) return;
+        seen_generation = pool_->generation_;
+      }
+      pool_->RunJobs();
+      {
+        MutexLock l(&pool_->mutex_);
+        if (--pool_->busy_workers_ == 0) {
+          pthread_cond_signal(&pool_->work_done_);
+        }
+      }
+    }
+  }
+
+private:
+  EncodeWorkerPool *const pool_;
+};
+
+EncodeWorkerPool::EncodeWorkerPool(int threads, uint32_t cpu_affinity_mask)
+  : generation_(0), busy_workers_(0), shutdown_(false),
+    job_(NULL), job_count_(0), next_index_(0) {
+  pthread_cond_init(&work_available_, NULL);
+  pthread_cond_init(&work_done_, NULL);
+  for (int i = 1; i < threads; ++i) {
+    Worker *worker = new Worker(this);
+    worker->Start(0, cpu_affinity_mask);
+    workers_.push_back(worker);
+  }
+}
+
+EncodeWorkerPool::~EncodeWorkerPool() {
+  {
+    MutexLock l(&mutex_);
+    shutdown_ = true;
+    pthread_cond_broadcast(&work_available_);
+  }
+  for (size_t i = 0; i < workers_.size(); ++i) {
+    delete workers_[i];  // Waits for the thread to finish.
+  }
+  pthread_cond_destroy(&work_available_);
+  pthread_cond_destroy(&work_done_);
+}
+
+void EncodeWorkerPool::RunJobs() {
+  for (;;) {
+    const int index = next_index_.fetch_add(1);
+    if (index >= job_count_) return;
+    (*job_)(index);
+  }
+}
+
+void EncodeWorkerPool::ParallelFor(int count,
+                                   const std::function<void(int)> &job) {
+  if (workers_.empty() || count <= 1) {
+    for (int i = 0; i < count; ++i) job(i);
+    return;
+  }
+  {
+    MutexLock l(&mutex_);
+    job_ = &job;
+    job_count_ = count;
+    next_index_ = 0;
+    busy_workers_ = workers_.size();
+    ++generation_;
+    pthread_cond_broadcast(&work_available_);
+  }
+  RunJobs();
+  MutexLock l(&mutex_);
+  while (busy_workers_ > 0) {
+    mutex_.WaitOn(&work_done_);
+  }
+  job_ = NULL;
+}
+
+}  // namespace internal
+}  // namespace rgb_matrix
@@ -18,46 +18,201 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
 #include "hardware-mapping.h"
+#include "thread.h"
 #include "../include/graphics.h"
 
 namespace rgb_matrix {
 class GPIO;
 class PinPulser;
 namespace internal {
+class EncodeWorkerPool;
 class RowAddressSetter;
 
 // An opaque type used within the framebuffer that can be used
 // to copy between PixelMappers.
+//
+// There is one of these per visible pixel, so it is kept small: each color
+// is a single gpio bit, which is stored as its position.
 struct PixelDesignator {
-  PixelDesignator() : gpio_word(-1), r_bit(0), g_bit(0), b_bit(0), mask(~0u){}
-  long gpio_word;
+  PixelDesignator()
+    : gpio_word(-1), r_pos_(0), g_pos_(0), b_pos_(0), profile_(0) {}
+
+  int32_t gpio_word;  // Offset in the bitplane buffer. -1: not displayed.
+
+  gpio_bits_t r_bit() const { return PosToBit(r_pos_); }
+  gpio_bits_t g_bit() const { return PosToBit(g_pos_); }
+  gpio_bits_t b_bit() const { return PosToBit(b_pos_); }
+
+  // Bits to keep when setting this pixel.
+  gpio_bits_t mask() const { return ~(r_bit() | g_bit() | b_bit()); }
+
+  // Each of the colors needs to be a single gpio bit or 0.
+  void SetColorBits(gpio_bits_t r, gpio_bits_t g, gpio_bits_t b) {
+    r_pos_ = BitToPos(r);
+    g_pos_ = BitToPos(g);
+    b_pos_ = BitToPos(b);
+  }
+
+  bool SameColorBits(const PixelDesignator &other) const {
+    return (r_pos_ == other.r_pos_ && g_pos_ == other.g_pos_
+            && b_pos_ == other.b_pos_);
+  }
+
+  // The uniformity correction profile of this pixel, 1..255, or 0 for none
+  // (see Framebuffer::InitUniformityProfiles()).
+  uint8_t profile() const { return profile_; }
+  void set_profile(uint8_t profile) { profile_ = profile; }
+
+private:
+  // Positions are stored off by one, so that 0 can represent 'no bit'.
+  static gpio_bits_t PosToBit(uint8_t pos) {
+    return ((gpio_bits_t)1 << pos) >> 1;
+  }
+  static uint8_t BitToPos(gpio_bits_t bit) {
+    return bit ? __builtin_ctzll(bit) + 1 : 0;
+  }
+
+  uint8_t r_pos_;
+  uint8_t g_pos_;
+  uint8_t b_pos_;
+  uint8_t profile_;  // Fits in what would be padding otherwise.
+};
+
+// All bits of a color used by any pixel.
+struct FillColorBits {
+  FillColorBits() : r_bit(0), g_bit(0), b_bit(0) {}
   gpio_bits_t r_bit;
   gpio_bits_t g_bit;
   gpio_bits_t b_bit;
-  gpio_bits_t mask;
 };
 
 class PixelDesignatorMap {
 public:
-  PixelDesignatorMap(int width, int height, const PixelDesignator &fill_bits);
+  // With "copies" > 1, each visible pixel can be shown on up to that many
+  // matrix pixels.
+  PixelDesignatorMap(int width, int height, const FillColorBits &fill_bits,
+                     int copies = 1);
   ~PixelDesignatorMap();
 
   // Get a writable version of the PixelDesignator. Outside Framebuffer used
   // by the RGBMatrix to re-assign mappings to new PixelDesignatorMappers.
   PixelDesignator *get(int x, int y);
 
+  // The designator of another matrix pixel showing the same visible pixel,
+  // 0 < copy < copies(). These are stored as further width x height layers
+  // after the first, so copy c of a pixel is c * width * height designators
+  // after get(x, y). Copies are filled from the first: once a copy is not
+  // displayed (gpio_word -1), neither are the following.
+  PixelDesignator *get(int x, int y, int copy);
+
   inline int width() const { return width_; }
   inline int height() const { return height_; }
+  inline int copies() const { return copies_; }
 
   // All bits that set red/green/blue pixels; used for Fill().
-  const PixelDesignator &GetFillColorBits() { return fill_bits_; }
+  const FillColorBits &GetFillColorBits() { return fill_bits_; }
+
+  // Visible pixels (as index y * width + x, plus copy * width * height for
+  // copies) grouped by the double row they are written to. Pixels of double
+  // row d are
+  //   pixels[row_start[d]] .. pixels[row_start[d + 1] - 1]
+  // sorted such that pixels with consecutive gpio words follow each other.
+  struct EncodeOrder {
+    std::vector<int> row_start;
+    std::vector<int> pixels;
+  };
+
+  // Get the EncodeOrder for a Framebuffer with the given number of double
+  // rows of "words_per_double_row" each. Calculated on first call.
+  const EncodeOrder &GetEncodeOrder(int double_rows, int words_per_double_row);
+
+  // A move of bitplane content: the color "bits" of "count" consecutive
+  // words, at most kMaxMoveRun, or with a count of 0 a single pixel to one
+  // with other color bits ("from" < 0: not shown, black).
+  static constexpr int kMaxMoveRun = 128;
+  struct WordMove {
+    int32_t to;
+    int32_t from;
+    int count;
+    gpio_bits_t bits;
+    PixelDesignator dst, src;  // Single pixel only.
+  };
+
+  // The moves that shift the content of the given region (within the
+  // visible area) by dx, dy, in the order to be applied. Calculated if the
+  // parameters differ from the last call.
+  const std::vector<WordMove> &GetScrollMoves(int dx, int dy, int x, int y,
+                                              int width, int height);
 
 private:
+  // Add moves to copy "count" pixels of row src_y starting at src_x to
+  // dst_x, dst_y. "backwards" goes from the last to the first pixel, so
+  // that overlapping pixels to the right are read before written. Runs with
+  // the same words as one in "merge" are added to that.
+  void AddRowMoves(int dst_x, int dst_y, int src_x, int src_y, int count,
+                   int copy, bool backwards,
+                   std::map<std::pair<int32_t, int32_t>, size_t> *merge);
+
+  struct ScrollMoves {
+    bool valid;
+    int dx, dy, x, y, width, height;
+    std::vector<WordMove> moves;
+  };
+
   const int width_;
   const int height_;
-  const PixelDesignator fill_bits_;  // Precalculated for fill.
+  const int copies_;
+  const FillColorBits fill_bits_;  // Precalculated for fill.
   PixelDesignator *const buffer_;
+  EncodeOrder encode_order_;
+  ScrollMoves scroll_moves_;
+};
+
+// Hands out equally sized, cache-line aligned buffers carved from larger
+// page aligned chunks. Released buffers are kept for re-use and only
+// returned to the system when the arena is destroyed, so creating and
+// deleting Framebuffers doesn't fragment the heap.
+class BufferArena {
+public:
+  // With "huge_pages", chunks are 2MB aligned and the kernel is advised to
+  // back them with transparent huge pages, saving TLB misses while dumping.
+  BufferArena(size_t buffer_size, bool huge_pages);
+  ~BufferArena();
+
+  void *Allocate();
+  void Release(void *buffer);
+
+private:
+  void AddChunk();
+
+  const size_t slot_size_;
+  const bool huge_pages_;
+  Mutex mutex_;  // Canvases might be unpacked from different threads.
+  int slots_total_;
+  std::vector<void*> free_;
+  std::vector<std::pair<void*, size_t> > chunks_;  // Mapped memory and size.
+};
+
+// Uniformity correction as read by Framebuffer::LoadUniformityCorrection():
+// color gains per profile and the areas of the matrix that use them.
+struct UniformityCorrection {
+  struct Gains {
+    float red, green, blue;    // 0 < gain <= 1
+  };
+  struct Area {
+    int x, y, width, height;   // Coordinates of the chains, before mappers.
+    int profile;               // 1 .. profiles.size()
+  };
+  std::vector<Gains> profiles;  // Profile p is profiles[p - 1].
+  std::vector<Area> areas;      // Later areas take precedence.
 };
 
 // Internal representation of the frame-buffer that as well can
@@ -66,62 +221,124 @@ private:
 // written out.
 class Framebuffer {
 public:
-  // Maximum usable bitplanes.
+  // Number of bitplanes the buffer is allocated for; chosen at runtime
+  // (--led-max-pwm-bits), up to kMaxBitPlanes.
   //
   // 11 bits seems to be a sweet spot in which we still get somewhat useful
   // refresh rate and have good color richness. This is the default setting
   // However, in low-light situations, we want to be able to scale down
-  // brightness more, having more bits at the bottom.
-  // TODO(hzeller): make the default 15 bit or so, but slide the use of
-  //  timing to lower bits if fewer bits requested to not affect the overall
-  //  refresh in that case.
-  //  This needs to be balanced to not create too agressive timing however.
-  //  To be explored in a separete commit.
-  //
-  // For now, if someone needs very low level of light, change this to
-  // say 13 and recompile. Run with --led-pwm-bits=13. Also, consider
+  // brightness more, having more bits at the bottom. Then choose say
+  // 13 bitplanes and run with --led-pwm-bits=13. Also, consider
   // --led-pwm-dither-bits=2 to have the refresh rate not suffer too much.
-  static constexpr int kBitPlanes = 11;
+  static constexpr int kMaxBitPlanes = 16;
   static constexpr int kDefaultBitPlanes = 11;
 
+  // The most significant bitplanes can be split in up to 2^kMaxSplitBits
+  // pulses (see InitGPIO()).
+  static constexpr int kMaxSplitBits = 4;
+
+  // All Framebuffers need to be created with the same "bitplanes" as
+  // passed to InitGPIO(). The optional "arena" provides the bitplane memory;
+  // its buffers need to be at least BitplaneBufferSize() bytes.
+  // The rows are shown in the order of CreateRowOrder().
   Framebuffer(int rows, int columns, int parallel,
-              int scan_mode,
+              int scan_mode, const char *scan_order,
               const char* led_sequence, bool inverse_color,
+              int bitplanes,
+              BufferArena *arena,
               PixelDesignatorMap **mapper);
   ~Framebuffer();
 
+  // Bytes of bitplane memory a Framebuffer with these parameters needs.
+  static size_t BitplaneBufferSize(int rows, int columns, int bitplanes);
+
+  // The order in which the double rows of panels with "rows" rows are shown.
+  // "scan_mode" 0 is progressive, 1 interlaced and 2 bit-reversed, i.e.
+  // each row is followed by the one farthest away from the rows so far.
+  // A "scan_order" overrides it: "stride:<n>" for every n-th row, then
+  // starting again one further, or a comma separated list of all double
+  // rows. Returns false with a message in "err" if "scan_order" is invalid.
+  static bool CreateRowOrder(int rows, int scan_mode, const char *scan_order,
+                             std::vector<uint8_t> *order, std::string *err);
+
+  // Read the uniformity correction file "filename" for chains of panels
+  // with "panel_rows" x "panel_cols" pixels. Returns false with a message
+  // in "err" if it can't be read or doesn't fit the chains.
+  static bool LoadUniformityCorrection(const char *filename,
+                                       int panel_rows, int panel_cols,
+                                       int chain, int parallel,
+                                       UniformityCorrection *correction,
+                                       std::string *err);
+
+  // Set the color gains of the uniformity correction profiles for all
+  // Framebuffers created afterwards. A pixel with a profile (see
+  // PixelDesignator::set_profile()) gets its colors mapped with a table
+  // scaled by these, so correcting costs a table selection per pixel.
+  static void InitUniformityProfiles(
+    const std::vector<UniformityCorrection::Gains> &profiles);
+
   // Initialize GPIO bits for output. Only call once.
   static void InitHardwareMapping(const char *named_hardware);
   static void InitGPIO(GPIO *io, int rows, int parallel,
                        bool allow_hardware_pulsing,
                        int pwm_lsb_nanoseconds,
                        int dither_bits,
-                       int row_address_type);
+                       int split_bits,
+                       int row_address_type,
+                       int bitplanes,
+                       bool skip_empty_planes,
+                       bool merge_identical_planes);
   static void InitializePanels(GPIO *io, const char *panel_type, int columns);
 
+  // Show all Framebuffers at the given brightness in percent by shortening
+  // the pulses instead of changing the encoded colors (call after
+  // InitGPIO()). Bitplanes too short to show are dropped. With
+  // luminance_correct, the steps are in perceived lightness. Safe to call
+  // while the refresh thread is running; it picks it up with the next frame.
+  static void SetOutputBrightness(uint8_t brightness, bool luminance_correct);
+
   // Set PWM bits used for output. Default is 11, but if you only deal with
   // simple comic-colors, 1 might be sufficient. Lower require less CPU.
-  // Returns boolean to signify if value was within range.
+  // Returns boolean to signify if value was within range; above the
+  // bitplanes allocated, it is limited to these.
   bool SetPWMBits(uint8_t value);
   uint8_t pwmbits() { return pwm_bits_; }
 
   // Map brightness of output linearly to input with CIE1931 profile.
-  void set_luminance_correct(bool on) { do_luminance_correct_ = on; }
+  void set_luminance_correct(bool on);
   bool luminance_correct() const { return do_luminance_correct_; }
 
   // Set brightness in percent; range=1..100
   // This will only affect newly set pixels.
-  void SetBrightness(uint8_t b) {
-    brightness_ = (b <= 100 ? (b != 0 ? b : 1) : 100);
-  }
+  void SetBrightness(uint8_t b);
   uint8_t brightness() { return brightness_; }
 
+  // Ordered dithering of the bits below the PWM bits shown, so that gradients
+  // don't band with few PWM bits. Only affects newly set pixels.
+  void set_spatial_dither(bool on);
+  bool spatial_dither() const { return spatial_dither_; }
+
   void DumpToMatrix(GPIO *io, int pwm_bits_to_show);
 
+  // The double rows in the order they are shown.
+  int double_rows() const { return double_rows_; }
+  const uint8_t *row_order() const { return row_order_; }
+
+  // Find consecutive bitplanes with the same content in double rows that
+  // changed since the last call, so that DumpToMatrix() can show them with
+  // a single pulse. Only does something with merging of identical planes
+  // enabled in InitGPIO().
+  void FindIdenticalPlanes() const;
+
   void Serialize(const char **data, size_t *len) const;
   bool Deserialize(const char *data, size_t len);
   void CopyFrom(const Framebuffer *other);
 
+  // Keep only the color bits of the parallel chains in use. The packed
+  // Framebuffer is shown and serialized as such, drawing unpacks it again.
+  // Returns false if packing would not save memory.
+  bool Pack();
+
   // Canvas-inspired methods, but we're not implementing this interface to not
   // have an unnecessary vtable.
   int width() const;
@@ -131,8 +348,59 @@ public:
   void Clear();
   void Fill(uint8_t red, uint8_t green, uint8_t blue);
 
+  // Set the pixels at "offsets" (y * width() + x) all to the same color,
+  // which then only needs to be mapped once.
+  void SetPixelsToColor(const int *offsets, int count,
+                        uint8_t red, uint8_t green, uint8_t blue);
+
+  // Move the content of the given region by dx, dy pixels; pixels moved in
+  // from outside the region are black.
+  void Scroll(int dx, int dy, int x, int y, int width, int height);
+
+  // -- Deferred encoding.
+  // Keep an RGB copy of the visible pixels to draw into. While deferred,
+  // drawing only goes to this staging buffer and is encoded into the
+  // bitplanes with EncodeStaged(), distributed over the "pool" (which
+  // is owned by the caller). The staging buffer is only usable after the
+  // next Clear() or Fill().
+  void EnableStaging(EncodeWorkerPool *pool);
+  // Re-create the staging buffer after the visible size changed.
+  void ResetStaging();
+  // Switch between deferred and direct encoding. Leaving deferred mode
+  // encodes pending changes.
+  void SetDeferred(bool deferred);
+  // Bring the bitplanes up to date with the staged pixels if anything was
+  // drawn since the last encoding. All visible pixels are then encoded with
+  // the current brightness and luminance correction.
+  void EncodeStaged() const;
+
+  // -- Reading pixels back.
+  // With the RGB shadow, the staging buffer is kept (also without deferred
+  // encoding), so that reading gives exactly the colors set. Otherwise
+  // pixels are decoded from the bitplanes, which is slower and only
+  // approximate with reduced brightness or pwm bits.
+  void set_rgb_shadow(bool on);
+  bool rgb_shadow() const { return rgb_shadow_; }
+  void GetPixel(int x, int y,
+                uint8_t *red, uint8_t *green, uint8_t *blue) const;
+  // Outside the visible area, pixels are black.
+  void GetPixels(int x, int y, int width, int height, Color *colors) const;
+
+  // -- Damage tracking.
+  // Make this the same as "other", which is marked as such. If both were
+  // the same after the last call, only the pixels drawn to since, on
+  // either, are copied; otherwise all.
+  void UpdateFrom(Framebuffer *other);
+
 private:
   static const struct HardwareMapping *hardware_mapping_;
+  static std::vector<UniformityCorrection::Gains> uniformity_profiles_;
+  struct ProfileLookup {
+    int users;
+    std::vector<uint16_t> table;
+  };
+  static std::map<uint32_t, ProfileLookup*> profile_lookups_;
+  static Mutex profile_lookups_mutex_;
   static RowAddressSetter *row_setter_;
 
   // This returns the gpio-bit for given color (one of 'R', 'G', 'B'). This is
@@ -144,19 +412,212 @@ private:
 
   void InitDefaultDesignator(int x, int y, const char *led_sequence,
                              PixelDesignator *designator);
+
+  // Number of pixels color-mapped in one go in SetPixelSpan().
+  static constexpr int kSpanChunk = 128;
+
+  // Set "count" pixels starting at visible (x, y) going right. The caller
+  // makes sure that the whole run is within the visible area.
+  void SetPixelSpan(int x, int y, int count, const Color *colors);
+
+  // Apply the moves of a Scroll(); all bitplanes written get the
+  // "lit_planes" occupancy.
+  void ApplyMoves(const std::vector<PixelDesignatorMap::WordMove> &moves,
+                  uint16_t lit_planes);
+
+  // Encode a pixel with mapped colors to the designator, which must be used,
+  // and its copies.
+  inline void EncodeCopies(const PixelDesignator *designator,
+                           uint16_t red, uint16_t green, uint16_t blue);
+  void EncodeMoreCopies(const PixelDesignator *designator,
+                        uint16_t red, uint16_t green, uint16_t blue);
+
+  // Map, dither and encode a pixel at visible x, y with the color tables
+  // of the profile of the designator and each of its copies.
+  void EncodeCorrected(int x, int y, const PixelDesignator *designator,
+                       uint8_t r, uint8_t g, uint8_t b);
+
+  // Encode "count" pixels with the given designators and mapped colors,
+  // finding runs for the encode kernel.
+  void EncodeDesignated(const PixelDesignator *const *designators,
+                        const uint16_t *red, const uint16_t *green,
+                        const uint16_t *blue, int count) const;
+
+  // Encode all staged pixels that are in the given double row.
+  void EncodeStagedDoubleRow(const PixelDesignatorMap::EncodeOrder &order,
+                             int double_row) const;
+
+  // Record a change to the double row the bitplane word "gpio_word" belongs
+  // to; the bitplanes that have a bit set in "planes" are (possibly) lit.
+  inline void MarkChanged(int32_t gpio_word, uint16_t planes) const {
+    const int double_row = gpio_word / (columns_ * bitplanes_);
+    plane_occupancy_[double_row] |= planes;
+    planes_changed_[double_row] = true;
+  }
+
+  void FindIdenticalPlanes(int double_row) const;
+
+  // Pixels changed; only recorded once UpdateFrom() was used.
+  inline void MarkDamaged(int x, int y, int count) {
+    if (damage_.empty() || y < 0 || y >= (int)damage_.size()) return;
+    DamageSpan &span = damage_[y];
+    span.x0 = std::min(span.x0, x);
+    span.x1 = std::max(span.x1, x + count);
+    damage_y0_ = std::min(damage_y0_, y);
+    damage_y1_ = std::max(damage_y1_, y + 1);
+  }
+  void MarkAllDamaged() { fully_damaged_ = true; }
+  void ResetDamage();
+  // Copy the pixels that are damaged in "damaged" from "other".
+  void CopyDamaged(const Framebuffer *other, const Framebuffer *damaged);
+
+  // Determine plane_occupancy_ from the bitplane content.
+  void RecalculateOccupancy();
+
+  // The content of bitplane "bit" in "double_row"; PlaneBytes() long.
+  // Packed or not.
+  const uint8_t *PlaneData(int double_row, int bit) const;
+  size_t PlaneBytes() const;
+
+  // -- Packed representation.
+  int PackedWordBytes() const;  // Bytes to store the color bits of a word.
+  size_t PackedSize() const;
+  template <typename T> void PackWords(T *out) const;
+  template <typename T> void UnpackWords(const T *in, gpio_bits_t *out) const;
+  template <typename T> static inline gpio_bits_t UnpackWord(T packed,
+                                                             int chains);
+  void ExpandPacked(gpio_bits_t *out) const;
+  void Unpack();           // Back to full gpio words.
+
+  // Copy the shown bitplanes of the double row at "row_data" to all double
+  // rows and update the bookkeeping as if all pixels were set to "color",
+  // which has the mapped bits "lit_planes".
+  void FillFromRow(const gpio_bits_t *row_data, uint16_t lit_planes,
+                   const Color &color);
+  gpio_bits_t *AllocateBitplanes();
+  void FreeBitplanes();
+  void ReleaseUnpacked();  // Free the memory not needed when packed.
+
+  // Switch on the clocked in bitplane "b" with the following bitplanes
+  // that have the same content. Returns the last bitplane shown.
+  static inline int PulsePlanes(int b, int end_plane, unsigned identical,
+                                bool scaled, const int *timing_ns);
+  template <typename T> void DumpPackedToMatrix(GPIO *io, int pwm_low_bit);
+
   inline void  MapColors(uint8_t r, uint8_t g, uint8_t b,
-                         uint16_t *red, uint16_t *green, uint16_t *blue);
+                         uint16_t *red, uint16_t *green, uint16_t *blue) const;
+
+  // The color table of "channel" (0: red, 1: green, 2: blue) for pixels
+  // with uniformity correction "profile".
+  const uint16_t *ColorTable(uint8_t profile, int channel) const {
+    return profile == 0
+      ? color_lookup_
+      : profile_lookup_ + ((profile - 1) * 3 + channel) * 256;
+  }
+  // Map colors for a pixel with the given profile.
+  inline void MapColors(uint8_t r, uint8_t g, uint8_t b, uint8_t profile,
+                        uint16_t *red, uint16_t *green, uint16_t *blue) const;
+
+  // With dithering, add the threshold for pixel x, y to mapped values, so
+  // that the PWM bits shown round up for a part of the pixels.
+  inline void DitherColors(int x, int y, uint16_t *red, uint16_t *green,
+                           uint16_t *blue) const;
+  // The same for "count" (at most kSpanChunk) pixels of a row, starting at
+  // x, y.
+  void DitherRow(int x, int y, uint16_t *red, uint16_t *green, uint16_t *blue,
+                 int count) const;
+
+  // If dithering changes the mapped "value" for some pixels.
+  bool IsDithered(uint16_t value) const;
+
+  // Recalculate dither_threshold_ after PWM bits or dithering changed.
+  void RebuildDitherThresholds();
+
+  // Recalculate color_lookup_ and profile_lookup_ after brightness or
+  // luminance correction changed.
+  void RebuildColorLookup();
+  // Stop using the shared profile_lookup_; deleted with its last user.
+  void ReleaseProfileLookup();
+
+  // The 8 bit color mapping to the shown bits of "value"; the inverse of
+  // the color table "lookup", as close as it gets.
+  uint8_t UnmapColor(uint16_t value, const uint16_t *lookup) const;
+  Color DecodePixel(int x, int y) const;  // From the bitplanes.
+  void DecodeToStaging();  // Make the staging buffer valid again.
+  inline gpio_bits_t WordAt(int index) const;  // Packed or not.
+
+  // DumpToMatrix() for a particular number of bitplanes and type of
+  // RowAddressSetter, so that the refresh loop has all strides as constants
+  // and calls the row setter directly. Chosen once in InitGPIO().
+  typedef void (Framebuffer::*DumpFunction)(GPIO *io, int pwm_low_bit);
+  template <int kPlanes, class RowSetter>
+  void DumpToMatrixImpl(GPIO *io, int pwm_low_bit);
+  template <class RowSetter>
+  static DumpFunction GetDumpFunction(int bitplanes);
+  static DumpFunction dump_function_;
+  static gpio_bits_t color_clk_mask_;  // Color bits and clock.
+  static bool skip_empty_planes_;
+  static bool merge_identical_planes_;
+  static int bitplanes_shown_;  // As given in InitGPIO().
+  static int plane_timing_ns_[kMaxBitPlanes];  // Pulse length of each plane.
+  // The refresh goes over all rows in this many passes; the bitplanes
+  // shown in each pass.
+  static int output_passes_;
+  static unsigned pass_planes_[1 << kMaxSplitBits];
+  // With brightness applied at output: shortened pulses; bitplanes below
+  // the first are not shown.
+  struct OutputTiming {
+    bool scaled;
+    int first_plane;
+    int timing_ns[kMaxBitPlanes];
+  };
+  // The timing set last by SetOutputBrightness(), as seen by the refresh
+  // thread. Taken once per frame, so a frame never mixes old and new.
+  static const OutputTiming &TakeOutputTiming();
+
+  // Handed over as a triple buffer: SetOutputBrightness() fills the back
+  // table and swaps it with the middle one, the refresh swaps the middle
+  // with its front table if that is newer. Neither ever touches a table
+  // the other one has.
+  static OutputTiming output_timing_[3];
+  static std::atomic<int> output_timing_middle_;  // Index | kNewOutputTiming
+  static int output_timing_back_;    // Only used by SetOutputBrightness().
+  static int output_timing_front_;   // Only used by the refresh thread.
+  static Mutex output_timing_mutex_;  // Serializes SetOutputBrightness().
+
+  // The gpio bits for 6 packed color bits of each parallel chain.
+  static gpio_bits_t unpack_table_[6][64];
+
   const int rows_;     // Number of rows. 16 or 32.
   const int parallel_; // Parallel rows of chains. 1 or 2.
   const int height_;   // rows * parallel
   const int columns_;  // Number of columns. Number of chained boards * 32.
+  const int bitplanes_;  // Bitplanes in the buffer.
 
   const int scan_mode_;
   const bool inverse_color_;
 
+  // Sequence in which the double rows are output; depends on scan mode.
+  uint8_t row_order_[32];
+
   uint8_t pwm_bits_;   // PWM bits to display.
   bool do_luminance_correct_;
   uint8_t brightness_;
+  bool spatial_dither_;
+  bool dither_active_;   // Dithering and fewer PWM bits than bitplanes.
+  uint16_t dither_threshold_[64];   // 8x8 pattern, below the PWM bits.
+
+  // 8 bit channel value to the bits to be set in the bitplanes, with
+  // luminance correction, brightness and color inversion already applied.
+  // The same for all channels, the led sequence is taken care of by the
+  // PixelDesignator bits.
+  uint16_t color_lookup_[256];
+  // The same scaled by the gains of each uniformity correction profile;
+  // per profile a table for red, green and blue. NULL without profiles.
+  // These are large with many profiles and only depend on the color
+  // settings, so all canvases with the same settings share them.
+  const uint16_t *profile_lookup_;
+  uint32_t profile_lookup_key_;   // Settings it is for.
 
   const int double_rows_;
   const size_t buffer_size_;
@@ -168,9 +629,48 @@ private:
   // Of course, that means that we store unrelated bits in the frame-buffer,
   // but it allows easy access in the critical section.
   gpio_bits_t *bitplane_buffer_;
+  BufferArena *const arena_;  // bitplane_buffer_ comes from here, if set.
   inline gpio_bits_t *ValueAt(int double_row, int column, int bit);
 
+  // For each double row one bit per bitplane: is there any pixel lit ?
+  // Only cleared by Clear() and Fill(), so pixels set back to black still
+  // count until then. Not used with inverse colors.
+  // Mutable, as it is updated with the encoding of staged pixels.
+  mutable uint16_t plane_occupancy_[32];
+
+  // For each double row one bit per bitplane: is it the same as the
+  // bitplane before ? Only valid if the row hasn't changed since.
+  mutable uint16_t identical_planes_[32];
+  mutable bool planes_changed_[32];
+
   PixelDesignatorMap **shared_mapper_;  // Storage in RGBMatrix.
+
+  // Deferred encoding. The staging buffer has the visible size at the time
+  // it was created; it is only "valid" if it reflects the bitplane content.
+  EncodeWorkerPool *encode_pool_;
+  Color *staging_;
+  int staging_width_;
+  int staging_height_;
+  bool staging_valid_;
+  bool deferred_;
+  mutable bool staging_dirty_;  // Staged pixels not encoded yet.
+  bool rgb_shadow_;             // Keep staging for reading back.
+
+  // Damage since the last UpdateFrom(): per visible row the columns drawn
+  // to, and the rows that have any. Empty until UpdateFrom() was used.
+  struct DamageSpan { int x0, x1; };  // Empty if x0 >= x1.
+  std::vector<DamageSpan> damage_;
+  int damage_y0_, damage_y1_;
+  bool fully_damaged_;
+  const Framebuffer *synced_with_;  // Had the same content at last update.
+
+  // Only color bits, PackedWordBytes() per word, if packed; the
+  // bitplane_buffer_ is NULL then.
+  uint8_t *packed_;
+
+  // With inverse colors: one double row of black, all bitplanes. Created on
+  // first Clear(), which then only needs to copy it.
+  gpio_bits_t *black_row_;
 };
 }  // namespace internal
 }  // namespace rgb_matrix
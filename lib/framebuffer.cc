@@ -21,14 +21,20 @@
 
 #include <assert.h>
 #include <ctype.h>
+#include <errno.h>
+#include <limits.h>
 #include <math.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include <algorithm>
+#include <map>
 
+#include "bitplane-encoder-internal.h"
 #include "gpio.h"
 #include "../include/graphics.h"
 
@@ -50,16 +56,219 @@ PixelDesignator *PixelDesignatorMap::get(int x, int y) {
   return buffer_ + (y*width_) + x;
 }
 
+PixelDesignator *PixelDesignatorMap::get(int x, int y, int copy) {
+  if (x < 0 || y < 0 || x >= width_ || y >= height_
+      || copy < 0 || copy >= copies_)
+    return NULL;
+  return buffer_ + (copy * height_ + y) * width_ + x;
+}
+
 PixelDesignatorMap::PixelDesignatorMap(int width, int height,
-                                       const PixelDesignator &fill_bits)
-  : width_(width), height_(height), fill_bits_(fill_bits),
-    buffer_(new PixelDesignator[width * height]) {
+                                       const FillColorBits &fill_bits,
+                                       int copies)
+  : width_(width), height_(height), copies_(copies), fill_bits_(fill_bits),
+    buffer_(new PixelDesignator[width * height * copies]) {
+  scroll_moves_.valid = false;
 }
 
 PixelDesignatorMap::~PixelDesignatorMap() {
   delete [] buffer_;
 }
 
+const PixelDesignatorMap::EncodeOrder &PixelDesignatorMap::GetEncodeOrder(
+  int double_rows, int words_per_double_row) {
+  if (!encode_order_.row_start.empty()) return encode_order_;
+
+  // Within a double row, the pixels of each sub-panel and chain share the
+  // same color bits; grouping by these makes neighboring words follow
+  // each other, so that they can be encoded as runs.
+  struct Entry {
+    int double_row;
+    gpio_bits_t color_bits;
+    long gpio_word;
+    int pixel;
+    bool operator<(const Entry &other) const {
+      if (double_row != other.double_row) return double_row < other.double_row;
+      if (color_bits != other.color_bits) return color_bits < other.color_bits;
+      return gpio_word < other.gpio_word;
+    }
+  };
+  std::vector<Entry> entries;
+  for (int i = 0; i < width_ * height_ * copies_; ++i) {
+    const PixelDesignator &d = buffer_[i];
+    if (d.gpio_word < 0) continue;
+    Entry e;
+    e.double_row = d.gpio_word / words_per_double_row;
+    e.color_bits = ~d.mask();
+    e.gpio_word = d.gpio_word;
+    e.pixel = i;
+    entries.push_back(e);
+  }
+  std::sort(entries.begin(), entries.end());
+
+  encode_order_.row_start.assign(double_rows + 1, 0);
+  encode_order_.pixels.reserve(entries.size());
+  for (size_t i = 0; i < entries.size(); ++i) {
+    encode_order_.row_start[entries[i].double_row + 1]++;
+    encode_order_.pixels.push_back(entries[i].pixel);
+  }
+  for (int row = 0; row < double_rows; ++row) {
+    encode_order_.row_start[row + 1] += encode_order_.row_start[row];
+  }
+  return encode_order_;
+}
+
+static constexpr size_t kCacheLineSize = 64;
+static constexpr size_t kHugePageSize = 2 << 20;
+static constexpr int kMaxChunkSlots = 32;
+
+BufferArena::BufferArena(size_t buffer_size, bool huge_pages)
+  : slot_size_((buffer_size + kCacheLineSize - 1) & ~(kCacheLineSize - 1)),
+    huge_pages_(huge_pages), slots_total_(0) {
+}
+
+BufferArena::~BufferArena() {
+  for (size_t i = 0; i < chunks_.size(); ++i) {
+    munmap(chunks_[i].first, chunks_[i].second);
+  }
+}
+
+void *BufferArena::Allocate() {
+  MutexLock l(&mutex_);
+  if (free_.empty()) AddChunk();
+  void *result = free_.back();
+  free_.pop_back();
+  return result;
+}
+
+void BufferArena::Release(void *buffer) {
+  MutexLock l(&mutex_);
+  free_.push_back(buffer);
+}
+
+void BufferArena::AddChunk() {
+  // Grow with the number of buffers in use, so that a few canvases need
+  // one or two chunks, but many transient ones don't map memory each time.
+  const int slots = std::min(std::max(slots_total_, 2), kMaxChunkSlots);
+  const size_t page = huge_pages_ ? kHugePageSize : sysconf(_SC_PAGESIZE);
+  const size_t size = (slots * slot_size_ + page - 1) / page * page;
+
+  // mmap() only guarantees regular page alignment. For huge pages, map
+  // one more and trim to a huge page boundary.
+  const size_t map_size = huge_pages_ ? size + kHugePageSize : size;
+  char *mem = (char*) mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) {
+    perror("Can't allocate framebuffer memory");
+    abort();
+  }
+  char *start = mem;
+  if (huge_pages_) {
+    start = (char*)(((uintptr_t)mem + kHugePageSize - 1) & ~(kHugePageSize - 1));
+    if (start > mem) munmap(mem, start - mem);
+    munmap(start + size, mem + map_size - (start + size));
+#ifdef MADV_HUGEPAGE
+    madvise(start, size, MADV_HUGEPAGE);  // Best effort; fine if not.
+#endif
+  }
+  chunks_.push_back(std::make_pair(start, size));
+
+  // Lowest address last, so that it is handed out first.
+  const int fit = size / slot_size_;
+  for (int i = fit - 1; i >= 0; --i) {
+    free_.push_back(start + i * slot_size_);
+  }
+  slots_total_ += fit;
+}
+
+void PixelDesignatorMap::AddRowMoves(
+  int dst_x, int dst_y, int src_x, int src_y, int count, int copy,
+  bool backwards, std::map<std::pair<int32_t, int32_t>, size_t> *merge) {
+  const PixelDesignator *const dst = get(dst_x, dst_y, copy);
+  const PixelDesignator *const src = get(src_x, src_y, copy);
+  std::vector<WordMove> *const moves = &scroll_moves_.moves;
+  const int step = backwards ? -1 : 1;
+  int i = backwards ? count - 1 : 0;
+  for (int remaining = count; remaining > 0; /**/) {
+    const PixelDesignator &d = dst[i];
+    const PixelDesignator &s = src[i];
+    if (d.gpio_word < 0) {   // Not shown anyway.
+      i += step;
+      --remaining;
+      continue;
+    }
+    WordMove move;
+    move.bits = ~d.mask();
+    int run = 1;
+    if (s.gpio_word >= 0 && d.SameColorBits(s)) {
+      // Neighbors in consecutive words with the same color bits, as in a
+      // standard panel row, are moved as a run of words.
+      while (run < remaining && run < kMaxMoveRun
+             && dst[i + run * step].gpio_word == d.gpio_word + run * step
+             && src[i + run * step].gpio_word == s.gpio_word + run * step
+             && dst[i + run * step].SameColorBits(d)
+             && src[i + run * step].SameColorBits(d)) {
+        ++run;
+      }
+      const int first = backwards ? 1 - run : 0;  // Lowest word of the run.
+      move.to = d.gpio_word + first;
+      move.from = s.gpio_word + first;
+      move.count = run;
+    } else {
+      move.to = d.gpio_word;
+      move.from = s.gpio_word;
+      move.count = 0;
+      move.dst = d;
+      move.src = s;
+    }
+    i += run * step;
+    remaining -= run;
+
+    if (merge != NULL && move.count > 0) {
+      // Other pixels in the same words that move the same way, e.g. the
+      // other half of the panel, are done in one go.
+      const std::pair<int32_t, int32_t> key(move.to, move.from);
+      std::map<std::pair<int32_t, int32_t>, size_t>::iterator found
+        = merge->find(key);
+      if (found != merge->end() && (*moves)[found->second].count == run) {
+        (*moves)[found->second].bits |= move.bits;
+        continue;
+      }
+      (*merge)[key] = moves->size();
+    }
+    moves->push_back(move);
+  }
+}
+
+const std::vector<PixelDesignatorMap::WordMove> &
+PixelDesignatorMap::GetScrollMoves(int dx, int dy, int x, int y,
+                                   int width, int height) {
+  ScrollMoves &c = scroll_moves_;
+  if (c.valid && c.dx == dx && c.dy == dy && c.x == x && c.y == y
+      && c.width == width && c.height == height) {
+    return c.moves;
+  }
+  c.moves.clear();
+  c.dx = dx; c.dy = dy; c.x = x; c.y = y; c.width = width; c.height = height;
+  c.valid = true;
+
+  // Rows in the order that reads each pixel before it is overwritten.
+  // Moving horizontally, rows don't depend on each other, so the moves of
+  // rows that share bitplane words can be merged. Copies are on other
+  // matrix pixels than the first, so each is moved on its own.
+  std::map<std::pair<int32_t, int32_t>, size_t> merge;
+  const int count = width - abs(dx);
+  const int dst_x = x + std::max(dx, 0);
+  for (int copy = 0; copy < copies_; ++copy) {
+    for (int i = 0; i < height - abs(dy); ++i) {
+      const int dst_y = (dy > 0) ? y + height - 1 - i : y + i;
+      AddRowMoves(dst_x, dst_y, dst_x - dx, dst_y - dy, count, copy, dx > 0,
+                  dy == 0 ? &merge : NULL);
+    }
+  }
+  return c.moves;
+}
+
 // Different panel types use different techniques to set the row address.
 // We abstract that away with different implementations of RowAddressSetter
 class RowAddressSetter {
@@ -73,7 +282,7 @@ namespace {
 
 // The default DirectRowAddressSetter just sets the address in parallel
 // output lines ABCDE with A the LSB and E the MSB.
-class DirectRowAddressSetter : public RowAddressSetter {
+class DirectRowAddressSetter final : public RowAddressSetter {
 public:
   DirectRowAddressSetter(int double_rows, const HardwareMapping &h)
     : row_mask_(0), last_row_(-1) {
@@ -119,7 +328,7 @@ private:
 // same time (if they have the same content), but that isn't implemented here.
 // BK, DIN and DCK are the designations on the SM5266P datasheet.
 // BK = Enable Input, DIN = Serial In, DCK = Clock
-class SM5266RowAddressSetter : public RowAddressSetter {
+class SM5266RowAddressSetter final : public RowAddressSetter {
 public:
   SM5266RowAddressSetter(int double_rows, const HardwareMapping &h)
     : row_mask_(h.a | h.b | h.c),
@@ -169,7 +378,7 @@ private:
   gpio_bits_t row_lookup_[32];
 };
 
-class B707ShiftRegisterRowAddressSetter : public RowAddressSetter {
+class B707ShiftRegisterRowAddressSetter final : public RowAddressSetter {
 public:
   B707ShiftRegisterRowAddressSetter(int double_rows, const HardwareMapping &h)
     : row_mask_(h.a | h.b | h.c),
@@ -206,7 +415,7 @@ private:
 };
 
 
-class ShiftRegisterRowAddressSetter : public RowAddressSetter {
+class ShiftRegisterRowAddressSetter final : public RowAddressSetter {
 public:
   ShiftRegisterRowAddressSetter(int double_rows, const HardwareMapping &h)
     : double_rows_(double_rows),
@@ -242,7 +451,7 @@ private:
 // Issue #823
 // An shift register row address setter that does not use B but C for the
 // data. Clock is inverted.
-class ABCShiftRegisterRowAddressSetter : public RowAddressSetter {
+class ABCShiftRegisterRowAddressSetter final : public RowAddressSetter {
 public:
   ABCShiftRegisterRowAddressSetter(int double_rows, const HardwareMapping &h)
     : double_rows_(double_rows),
@@ -287,7 +496,7 @@ private:
 // Line B  | 1 | 0 | 1 | 1
 // Line C  | 1 | 1 | 0 | 1
 // Line D  | 1 | 1 | 1 | 0
-class DirectABCDLineRowAddressSetter : public RowAddressSetter {
+class DirectABCDLineRowAddressSetter final : public RowAddressSetter {
 public:
   DirectABCDLineRowAddressSetter(int double_rows, const HardwareMapping &h)
     : last_row_(-1) {
@@ -318,26 +527,70 @@ private:
 
 }
 
+constexpr int Framebuffer::kMaxBitPlanes;
+constexpr int Framebuffer::kDefaultBitPlanes;
+constexpr int Framebuffer::kMaxSplitBits;
+constexpr int Framebuffer::kSpanChunk;
+constexpr int PixelDesignatorMap::kMaxMoveRun;
 const struct HardwareMapping *Framebuffer::hardware_mapping_ = NULL;
 RowAddressSetter *Framebuffer::row_setter_ = NULL;
+Framebuffer::DumpFunction Framebuffer::dump_function_ = NULL;
+gpio_bits_t Framebuffer::color_clk_mask_ = 0;
+bool Framebuffer::skip_empty_planes_ = false;
+bool Framebuffer::merge_identical_planes_ = false;
+int Framebuffer::bitplanes_shown_ = 0;
+int Framebuffer::plane_timing_ns_[Framebuffer::kMaxBitPlanes];
+int Framebuffer::output_passes_ = 1;
+unsigned Framebuffer::pass_planes_[1 << Framebuffer::kMaxSplitBits] = { ~0u };
+static const int kNewOutputTiming = 4;
+Framebuffer::OutputTiming Framebuffer::output_timing_[3];
+std::atomic<int> Framebuffer::output_timing_middle_(1);
+int Framebuffer::output_timing_back_ = 0;
+int Framebuffer::output_timing_front_ = 2;
+Mutex Framebuffer::output_timing_mutex_;
+gpio_bits_t Framebuffer::unpack_table_[6][64];
+std::vector<UniformityCorrection::Gains> Framebuffer::uniformity_profiles_;
+std::map<uint32_t, Framebuffer::ProfileLookup*> Framebuffer::profile_lookups_;
+Mutex Framebuffer::profile_lookups_mutex_;
 
 Framebuffer::Framebuffer(int rows, int columns, int parallel,
-                         int scan_mode,
+                         int scan_mode, const char *scan_order,
                          const char *led_sequence, bool inverse_color,
+                         int bitplanes,
+                         BufferArena *arena,
                          PixelDesignatorMap **mapper)
   : rows_(rows),
     parallel_(parallel),
     height_(rows * parallel),
     columns_(columns),
+    bitplanes_(bitplanes),
     scan_mode_(scan_mode),
     inverse_color_(inverse_color),
-    pwm_bits_(kBitPlanes), do_luminance_correct_(true), brightness_(100),
+    pwm_bits_(bitplanes), do_luminance_correct_(true), brightness_(100),
+    spatial_dither_(false), dither_active_(false),
+    profile_lookup_(NULL), profile_lookup_key_(0),
     double_rows_(rows / SUB_PANELS_),
-    buffer_size_(double_rows_ * columns_ * kBitPlanes * sizeof(gpio_bits_t)),
-    shared_mapper_(mapper) {
+    buffer_size_(double_rows_ * columns_ * bitplanes_ * sizeof(gpio_bits_t)),
+    arena_(arena), shared_mapper_(mapper),
+    encode_pool_(NULL), staging_(NULL), staging_width_(0), staging_height_(0),
+    staging_valid_(false), deferred_(false), staging_dirty_(false),
+    rgb_shadow_(false), damage_y0_(0), damage_y1_(0), fully_damaged_(true),
+    synced_with_(NULL),
+    packed_(NULL), black_row_(NULL) {
   assert(hardware_mapping_ != NULL);   // Called InitHardwareMapping() ?
   assert(shared_mapper_ != NULL);  // Storage should be provided by RGBMatrix.
   assert(rows_ >=4 && rows_ <= 64 && rows_ % 2 == 0);
+  assert(bitplanes_ >= 1 && bitplanes_ <= kMaxBitPlanes);
+  assert(double_rows_ <= 32);  // need to resize row_order_
+
+  std::vector<uint8_t> row_order;
+  std::string row_order_err;
+  if (!CreateRowOrder(rows, scan_mode_, scan_order, &row_order,
+                      &row_order_err)) {
+    fprintf(stderr, "%s", row_order_err.c_str());
+    abort();
+  }
+  std::copy(row_order.begin(), row_order.end(), row_order_);
   if (parallel > hardware_mapping_->max_parallel_chains) {
     fprintf(stderr, "The %s GPIO mapping only supports %d parallel chain%s, "
             "but %d was requested.\n", hardware_mapping_->name,
@@ -347,7 +600,12 @@ Framebuffer::Framebuffer(int rows, int columns, int parallel,
   }
   assert(parallel >= 1 && parallel <= 6);
 
-  bitplane_buffer_ = new gpio_bits_t[double_rows_ * columns_ * kBitPlanes];
+  bitplane_buffer_ = AllocateBitplanes();
+  memset(plane_occupancy_, 0, sizeof(plane_occupancy_));
+  memset(identical_planes_, 0, sizeof(identical_planes_));
+  memset(planes_changed_, true, sizeof(planes_changed_));
+  RebuildColorLookup();
+  RebuildDitherThresholds();
 
   // If we're the first Framebuffer created, the shared PixelMapper is
   // still NULL, so create one.
@@ -364,7 +622,7 @@ Framebuffer::Framebuffer(int rows, int columns, int parallel,
     gpio_bits_t r = h.p0_r1 | h.p0_r2 | h.p1_r1 | h.p1_r2 | h.p2_r1 | h.p2_r2 | h.p3_r1 | h.p3_r2 | h.p4_r1 | h.p4_r2 | h.p5_r1 | h.p5_r2;
     gpio_bits_t g = h.p0_g1 | h.p0_g2 | h.p1_g1 | h.p1_g2 | h.p2_g1 | h.p2_g2 | h.p3_g1 | h.p3_g2 | h.p4_g1 | h.p4_g2 | h.p5_g1 | h.p5_g2;
     gpio_bits_t b = h.p0_b1 | h.p0_b2 | h.p1_b1 | h.p1_b2 | h.p2_b1 | h.p2_b2 | h.p3_b1 | h.p3_b2 | h.p4_b1 | h.p4_b2 | h.p5_b1 | h.p5_b2;
-    PixelDesignator fill_bits;
+    FillColorBits fill_bits;
     fill_bits.r_bit = GetGpioFromLedSequence('R', led_sequence, r, g, b);
     fill_bits.g_bit = GetGpioFromLedSequence('G', led_sequence, r, g, b);
     fill_bits.b_bit = GetGpioFromLedSequence('B', led_sequence, r, g, b);
@@ -380,8 +638,16 @@ Framebuffer::Framebuffer(int rows, int columns, int parallel,
   Clear();
 }
 
+size_t Framebuffer::BitplaneBufferSize(int rows, int columns, int bitplanes) {
+  return (rows / SUB_PANELS_) * columns * bitplanes * sizeof(gpio_bits_t);
+}
+
 Framebuffer::~Framebuffer() {
-  delete [] bitplane_buffer_;
+  ReleaseProfileLookup();
+  FreeBitplanes();
+  delete [] staging_;
+  delete [] packed_;
+  delete [] black_row_;
 }
 
 // TODO: this should also be parsed from some special formatted string, e.g.
@@ -427,13 +693,37 @@ Framebuffer::~Framebuffer() {
       ++mapping->max_parallel_chains;
   }
   hardware_mapping_ = mapping;
+
+  // The color bits of each parallel chain, in the order they are packed.
+  const struct HardwareMapping &h = *mapping;
+  const gpio_bits_t chain_bits[6][6] = {
+    { h.p0_r1, h.p0_g1, h.p0_b1, h.p0_r2, h.p0_g2, h.p0_b2 },
+    { h.p1_r1, h.p1_g1, h.p1_b1, h.p1_r2, h.p1_g2, h.p1_b2 },
+    { h.p2_r1, h.p2_g1, h.p2_b1, h.p2_r2, h.p2_g2, h.p2_b2 },
+    { h.p3_r1, h.p3_g1, h.p3_b1, h.p3_r2, h.p3_g2, h.p3_b2 },
+    { h.p4_r1, h.p4_g1, h.p4_b1, h.p4_r2, h.p4_g2, h.p4_b2 },
+    { h.p5_r1, h.p5_g1, h.p5_b1, h.p5_r2, h.p5_g2, h.p5_b2 },
+  };
+  for (int chain = 0; chain < 6; ++chain) {
+    for (int packed = 0; packed < 64; ++packed) {
+      gpio_bits_t bits = 0;
+      for (int i = 0; i < 6; ++i) {
+        if (packed & (1 << i)) bits |= chain_bits[chain][i];
+      }
+      unpack_table_[chain][packed] = bits;
+    }
+  }
 }
 
 /* static */ void Framebuffer::InitGPIO(GPIO *io, int rows, int parallel,
                                         bool allow_hardware_pulsing,
                                         int pwm_lsb_nanoseconds,
                                         int dither_bits,
-                                        int row_address_type) {
+                                        int split_bits,
+                                        int row_address_type,
+                                        int bitplanes,
+                                        bool skip_empty_planes,
+                                        bool merge_identical_planes) {
   if (sOutputEnablePulser != NULL)
     return;  // already initialized.
 
@@ -460,25 +750,39 @@ Framebuffer::~Framebuffer() {
     all_used_bits |= h.p5_r1 | h.p5_g1 | h.p5_b1 | h.p5_r2 | h.p5_g2 | h.p5_b2;
   }
 
+  // All color bits so far, which are the ones we clock in with each column.
+  color_clk_mask_ = (all_used_bits & ~(h.output_enable | h.strobe)) | h.clock;
+  skip_empty_planes_ = skip_empty_planes;
+  merge_identical_planes_ = merge_identical_planes;
+  bitplanes_shown_ = bitplanes;
+
   const int double_rows = rows / SUB_PANELS_;
   switch (row_address_type) {
   case 0:
     row_setter_ = new DirectRowAddressSetter(double_rows, h);
+    dump_function_ = GetDumpFunction<DirectRowAddressSetter>(bitplanes);
     break;
   case 1:
     row_setter_ = new ShiftRegisterRowAddressSetter(double_rows, h);
+    dump_function_ = GetDumpFunction<ShiftRegisterRowAddressSetter>(bitplanes);
     break;
   case 2:
     row_setter_ = new DirectABCDLineRowAddressSetter(double_rows, h);
+    dump_function_ = GetDumpFunction<DirectABCDLineRowAddressSetter>(bitplanes);
     break;
   case 3:
     row_setter_ = new ABCShiftRegisterRowAddressSetter(double_rows, h);
+    dump_function_
+      = GetDumpFunction<ABCShiftRegisterRowAddressSetter>(bitplanes);
     break;
   case 4:
     row_setter_ = new SM5266RowAddressSetter(double_rows, h);
+    dump_function_ = GetDumpFunction<SM5266RowAddressSetter>(bitplanes);
     break;
   case 5:
     row_setter_ = new B707ShiftRegisterRowAddressSetter(double_rows, h);
+    dump_function_
+      = GetDumpFunction<B707ShiftRegisterRowAddressSetter>(bitplanes);
     break;
 
 
@@ -496,12 +800,39 @@ Framebuffer::~Framebuffer() {
                                              is_some_adafruit_hat);
   assert(result == all_used_bits);  // Impl: all bits declared in gpio.cc ?
 
+  // With split bits, the most significant bitplanes are not shown in one
+  // long pulse, but in pulses as long as that of the last plane not split,
+  // spread over several passes over all rows: the MSB in 2^split_bits
+  // pulses, one per pass, the next in half as many and so on. So the
+  // brightest part of each row flickers at a multiple of the refresh rate.
+  // Splitting only works for planes with doubling pulse lengths, i.e.
+  // above the dither bits.
+  split_bits = std::max(0, std::min(split_bits, bitplanes - 1 - dither_bits));
+  const int last_whole = bitplanes - 1 - split_bits;
+
   std::vector<int> bitplane_timings;
   uint32_t timing_ns = pwm_lsb_nanoseconds;
-  for (int b = 0; b < kBitPlanes; ++b) {
-    bitplane_timings.push_back(timing_ns);
+  for (int b = 0; b < bitplanes; ++b) {
+    const int pulse_ns = (b > last_whole)
+      ? plane_timing_ns_[last_whole]
+      : timing_ns;
+    bitplane_timings.push_back(pulse_ns);
+    plane_timing_ns_[b] = pulse_ns;
     if (b >= dither_bits) timing_ns *= 2;
   }
+
+  output_passes_ = 1 << split_bits;
+  for (int pass = 0; pass < output_passes_; ++pass) {
+    // Planes not split are all shown in the first pass; the split ones
+    // evenly spread, e.g. with 4 passes the MSB in each, the next in the
+    // second and fourth.
+    unsigned planes = (pass == 0) ? (2u << last_whole) - 1 : 0;
+    for (int b = last_whole + 1; b < bitplanes; ++b) {
+      const int period = 1 << (bitplanes - 1 - b);
+      if (pass % period == period - 1) planes |= 1u << b;
+    }
+    pass_planes_[pass] = planes;
+  }
   sOutputEnablePulser = PinPulser::Create(io, h.output_enable,
                                           allow_hardware_pulsing,
                                           bitplane_timings);
@@ -609,101 +940,325 @@ static void InitFM6127(GPIO *io, const struct HardwareMapping &h, int columns) {
 }
 
 bool Framebuffer::SetPWMBits(uint8_t value) {
-  if (value < 1 || value > kBitPlanes)
+  if (value < 1)
     return false;
-  pwm_bits_ = value;
-  return true;
+  // More than allocated: all bitplanes are used, but that is reported.
+  pwm_bits_ = std::min<int>(value, bitplanes_);
+  RebuildDitherThresholds();
+  return value <= bitplanes_;
 }
 
 inline gpio_bits_t *Framebuffer::ValueAt(int double_row, int column, int bit) {
-  return &bitplane_buffer_[ double_row * (columns_ * kBitPlanes)
+  return &bitplane_buffer_[ double_row * (columns_ * bitplanes_)
                             + bit * columns_
                             + column ];
 }
 
 void Framebuffer::Clear() {
+  if (packed_ != NULL) Unpack();
+  MarkAllDamaged();
   if (inverse_color_) {
-    Fill(0, 0, 0);
+    if (black_row_ == NULL) {
+      // Black is all bits set, independent of brightness.
+      const FillColorBits &fill = (*shared_mapper_)->GetFillColorBits();
+      black_row_ = new gpio_bits_t[columns_ * bitplanes_];
+      std::fill(black_row_, black_row_ + columns_ * bitplanes_,
+                fill.r_bit | fill.g_bit | fill.b_bit);
+    }
+    FillFromRow(black_row_, color_lookup_[0], Color());
   } else  {
     // Cheaper.
     memset(bitplane_buffer_, 0,
-           sizeof(*bitplane_buffer_) * double_rows_ * columns_ * kBitPlanes);
+           sizeof(*bitplane_buffer_) * double_rows_ * columns_ * bitplanes_);
+    memset(plane_occupancy_, 0, sizeof(plane_occupancy_));
+    // All planes are the same now.
+    memset(identical_planes_, 0xff, sizeof(identical_planes_));
+    memset(planes_changed_, false, sizeof(planes_changed_));
+    if (staging_ != NULL) {
+      std::fill(staging_, staging_ + staging_width_ * staging_height_,
+                Color());
+      staging_valid_ = true;
+      staging_dirty_ = false;
+    }
   }
 }
 
-// Do CIE1931 luminance correction and scale to output bitplanes
-static uint16_t luminance_cie1931(uint8_t c, uint8_t brightness) {
-  float out_factor = ((1 << internal::Framebuffer::kBitPlanes) - 1);
-  float v = (float) c * brightness / 255.0;
-  return roundf(out_factor * ((v <= 8) ? v / 902.3 : pow((v + 16) / 116.0, 3)));
-}
-
-struct ColorLookup {
-  uint16_t color[256];
-};
-static ColorLookup *CreateLuminanceCIE1931LookupTable() {
-  ColorLookup *for_brightness = new ColorLookup[100];
-  for (int c = 0; c < 256; ++c)
-    for (int b = 0; b < 100; ++b)
-      for_brightness[b].color[c] = luminance_cie1931(c, b + 1);
-
-  return for_brightness;
+// Relative luminance (0..1) of given CIE1931 lightness (0..100).
+static double cie1931(double lightness) {
+  return ((lightness <= 8)
+          ? lightness / 902.3
+          : pow((lightness + 16) / 116.0, 3));
 }
 
-static inline uint16_t CIEMapColor(uint8_t brightness, uint8_t c) {
-  static ColorLookup *luminance_lookup = CreateLuminanceCIE1931LookupTable();
-  return luminance_lookup[brightness - 1].color[c];
+// Do CIE1931 luminance correction and scale to output bitplanes
+static uint16_t luminance_cie1931(uint8_t c, uint8_t brightness,
+                                  int bitplanes) {
+  float out_factor = ((1 << bitplanes) - 1);
+  float v = (float) c * brightness / 255.0;
+  return roundf(out_factor * cie1931(v));
 }
 
 // Non luminance correction. TODO: consider getting rid of this.
-static inline uint16_t DirectMapColor(uint8_t brightness, uint8_t c) {
+static inline uint16_t DirectMapColor(uint8_t brightness, uint8_t c,
+                                      int bitplanes) {
   // simple scale down the color value
   c = c * brightness / 100;
 
   // shift to be left aligned with top-most bits.
-  constexpr int shift = internal::Framebuffer::kBitPlanes - 8;
+  const int shift = bitplanes - 8;
   return (shift > 0) ? (c << shift) : (c >> -shift);
 }
 
+void Framebuffer::RebuildColorLookup() {
+  uint16_t values[256];
+  for (int c = 0; c < 256; ++c) {
+    values[c] = do_luminance_correct_
+      ? luminance_cie1931(c, brightness_, bitplanes_)
+      : DirectMapColor(brightness_, c, bitplanes_);
+    color_lookup_[c] = inverse_color_ ? ~values[c] : values[c];
+  }
+
+  const int profiles = uniformity_profiles_.size();
+  const uint32_t key = brightness_ | (do_luminance_correct_ << 8)
+    | (inverse_color_ << 9) | (bitplanes_ << 10);
+  if (profile_lookup_ != NULL && key == profile_lookup_key_) return;
+  ReleaseProfileLookup();
+  if (profiles == 0) return;
+
+  MutexLock l(&profile_lookups_mutex_);
+  ProfileLookup *&lookup = profile_lookups_[key];
+  if (lookup == NULL) {
+    lookup = new ProfileLookup();
+    lookup->users = 0;
+    lookup->table.resize(profiles * 3 * 256);
+    // The values are proportional to the time the LEDs are on, so the gains
+    // simply scale them.
+    for (int p = 0; p < profiles; ++p) {
+      const UniformityCorrection::Gains &gains = uniformity_profiles_[p];
+      const float channel_gain[3] = { gains.red, gains.green, gains.blue };
+      for (int channel = 0; channel < 3; ++channel) {
+        uint16_t *const table = &lookup->table[(p * 3 + channel) * 256];
+        for (int c = 0; c < 256; ++c) {
+          const uint16_t scaled = lround(values[c] * channel_gain[channel]);
+          table[c] = inverse_color_ ? ~scaled : scaled;
+        }
+      }
+    }
+  }
+  ++lookup->users;
+  profile_lookup_ = lookup->table.data();
+  profile_lookup_key_ = key;
+}
+
+void Framebuffer::ReleaseProfileLookup() {
+  if (profile_lookup_ == NULL) return;
+  MutexLock l(&profile_lookups_mutex_);
+  std::map<uint32_t, ProfileLookup*>::iterator found
+    = profile_lookups_.find(profile_lookup_key_);
+  assert(found != profile_lookups_.end());
+  if (--found->second->users == 0) {
+    delete found->second;
+    profile_lookups_.erase(found);
+  }
+  profile_lookup_ = NULL;
+}
+
+/* static */ void Framebuffer::SetOutputBrightness(uint8_t brightness,
+                                                  bool luminance_correct) {
+  MutexLock l(&output_timing_mutex_);
+  // The refresh thread might be using the front and middle table right
+  // now, so the new timing is built in the back table, then published.
+  OutputTiming *const timing = &output_timing_[output_timing_back_];
+  timing->scaled = (brightness < 100 && bitplanes_shown_ > 0);
+  timing->first_plane = 0;
+  if (timing->scaled) {
+    const double factor = luminance_correct
+      ? cie1931(brightness)
+      : brightness / 100.0;
+    // Pulses shorter than the shortest we're set up for can't be shown, so
+    // these bitplanes are dropped; the most significant is always shown.
+    const int shortest_ns = plane_timing_ns_[0];
+    int first_plane = 0;
+    for (int b = 0; b < bitplanes_shown_; ++b) {
+      timing->timing_ns[b] = lround(plane_timing_ns_[b] * factor);
+      if (timing->timing_ns[b] < shortest_ns) first_plane = b + 1;
+    }
+    if (first_plane >= bitplanes_shown_) {
+      first_plane = bitplanes_shown_ - 1;
+      timing->timing_ns[first_plane] = shortest_ns;
+    }
+    timing->first_plane = first_plane;
+  }
+  output_timing_back_ = output_timing_middle_.exchange(
+    output_timing_back_ | kNewOutputTiming, std::memory_order_acq_rel)
+    & ~kNewOutputTiming;
+}
+
+/* static */ const Framebuffer::OutputTiming &Framebuffer::TakeOutputTiming() {
+  if (output_timing_middle_.load(std::memory_order_relaxed)
+      & kNewOutputTiming) {
+    output_timing_front_ = output_timing_middle_.exchange(
+      output_timing_front_, std::memory_order_acq_rel) & ~kNewOutputTiming;
+  }
+  return output_timing_[output_timing_front_];
+}
+
+void Framebuffer::set_luminance_correct(bool on) {
+  if (on == do_luminance_correct_) return;
+  do_luminance_correct_ = on;
+  RebuildColorLookup();
+}
+
+void Framebuffer::SetBrightness(uint8_t b) {
+  const uint8_t brightness = (b <= 100 ? (b != 0 ? b : 1) : 100);
+  if (brightness == brightness_) return;
+  brightness_ = brightness;
+  RebuildColorLookup();
+}
+
 inline void Framebuffer::MapColors(
   uint8_t r, uint8_t g, uint8_t b,
-  uint16_t *red, uint16_t *green, uint16_t *blue) {
+  uint16_t *red, uint16_t *green, uint16_t *blue) const {
+  *red   = color_lookup_[r];
+  *green = color_lookup_[g];
+  *blue  = color_lookup_[b];
+}
 
-  if (do_luminance_correct_) {
-    *red   = CIEMapColor(brightness_, r);
-    *green = CIEMapColor(brightness_, g);
-    *blue  = CIEMapColor(brightness_, b);
-  } else {
-    *red   = DirectMapColor(brightness_, r);
-    *green = DirectMapColor(brightness_, g);
-    *blue  = DirectMapColor(brightness_, b);
+inline void Framebuffer::MapColors(
+  uint8_t r, uint8_t g, uint8_t b, uint8_t profile,
+  uint16_t *red, uint16_t *green, uint16_t *blue) const {
+  *red   = ColorTable(profile, 0)[r];
+  *green = ColorTable(profile, 1)[g];
+  *blue  = ColorTable(profile, 2)[b];
+}
+
+void Framebuffer::set_spatial_dither(bool on) {
+  spatial_dither_ = on;
+  RebuildDitherThresholds();
+}
+
+void Framebuffer::RebuildDitherThresholds() {
+  // Bayer matrix: consecutive thresholds are spread as far apart as
+  // possible, so the dither pattern has mostly high frequencies.
+  static const uint8_t kBayer8[64] = {
+     0, 32,  8, 40,  2, 34, 10, 42,
+    48, 16, 56, 24, 50, 18, 58, 26,
+    12, 44,  4, 36, 14, 46,  6, 38,
+    60, 28, 52, 20, 62, 30, 54, 22,
+     3, 35, 11, 43,  1, 33,  9, 41,
+    51, 19, 59, 27, 49, 17, 57, 25,
+    15, 47,  7, 39, 13, 45,  5, 37,
+    63, 31, 55, 23, 61, 29, 53, 21,
+  };
+  const int dropped_bits = bitplanes_ - pwm_bits_;
+  dither_active_ = spatial_dither_ && dropped_bits > 0;
+  for (int i = 0; i < 64; ++i) {
+    // Thresholds evenly spaced in [0, step) of the lowest plane shown.
+    dither_threshold_[i] = (dropped_bits >= 6)
+      ? kBayer8[i] << (dropped_bits - 6)
+      : kBayer8[i] >> (6 - dropped_bits);
   }
+}
 
-  if (inverse_color_) {
-    *red = ~(*red);
-    *green = ~(*green);
-    *blue = ~(*blue);
+// Add "threshold" to a mapped value, saturating at the largest value, so
+// that it rounds to the next PWM step for a part of the pixels.
+static inline uint16_t DitherValue(uint16_t value, uint16_t threshold,
+                                   uint16_t invert, uint16_t max_value) {
+  value ^= invert;
+  const uint16_t room = max_value - value;
+  value += (threshold < room) ? threshold : room;
+  return value ^ invert;
+}
+
+bool Framebuffer::IsDithered(uint16_t value) const {
+  const uint16_t max_value = (1 << bitplanes_) - 1;
+  const uint16_t below_shown = (1 << (bitplanes_ - pwm_bits_)) - 1;
+  value ^= inverse_color_ ? 0xffff : 0;
+  return (value & below_shown) != 0 && value < max_value;
+}
+
+inline void Framebuffer::DitherColors(int x, int y, uint16_t *red,
+                                      uint16_t *green, uint16_t *blue) const {
+  const uint16_t threshold = dither_threshold_[(y & 7) * 8 + (x & 7)];
+  const uint16_t invert = inverse_color_ ? 0xffff : 0;
+  const uint16_t max_value = (1 << bitplanes_) - 1;
+  *red = DitherValue(*red, threshold, invert, max_value);
+  *green = DitherValue(*green, threshold, invert, max_value);
+  *blue = DitherValue(*blue, threshold, invert, max_value);
+}
+
+void Framebuffer::DitherRow(int x, int y, uint16_t *red, uint16_t *green,
+                            uint16_t *blue, int count) const {
+  // The thresholds for the row laid out for all pixels first, so that the
+  // loop below vectorizes.
+  const uint16_t *const pattern = dither_threshold_ + (y & 7) * 8;
+  uint16_t thresholds[kSpanChunk + 8];
+  for (int i = 0; i < count + 8; i += 8) {
+    for (int k = 0; k < 8; ++k) thresholds[i + k] = pattern[k];
+  }
+  const uint16_t *const threshold = thresholds + (x & 7);
+  const uint16_t invert = inverse_color_ ? 0xffff : 0;
+  const uint16_t max_value = (1 << bitplanes_) - 1;
+  for (int i = 0; i < count; ++i) {
+    red[i] = DitherValue(red[i], threshold[i], invert, max_value);
+    green[i] = DitherValue(green[i], threshold[i], invert, max_value);
+    blue[i] = DitherValue(blue[i], threshold[i], invert, max_value);
   }
 }
 
 void Framebuffer::Fill(uint8_t r, uint8_t g, uint8_t b) {
+  if (packed_ != NULL) Unpack();
+  MarkAllDamaged();
   uint16_t red, green, blue;
   MapColors(r, g, b, &red, &green, &blue);
-  const PixelDesignator &fill = (*shared_mapper_)->GetFillColorBits();
+  if ((dither_active_ && (IsDithered(red) || IsDithered(green)
+                          || IsDithered(blue)))
+      || profile_lookup_ != NULL) {
+    // Not the same for all double rows (or pixels with uniformity
+    // correction); the pixels have to be set.
+    std::vector<Color> row(width(), Color(r, g, b));
+    for (int y = 0; y < height(); ++y) {
+      SetPixels(0, y, width(), 1, row.data());
+    }
+    return;
+  }
+  const FillColorBits &fill = (*shared_mapper_)->GetFillColorBits();
 
-  for (int bits = kBitPlanes - pwm_bits_; bits < kBitPlanes; ++bits) {
+  // All double rows are the same: only build the first one, plane by plane,
+  // and copy that to the others.
+  gpio_bits_t *const first_row = ValueAt(0, 0, 0);
+  for (int bits = bitplanes_ - pwm_bits_; bits < bitplanes_; ++bits) {
     uint16_t mask = 1 << bits;
     gpio_bits_t plane_bits = 0;
     plane_bits |= ((red & mask) == mask)   ? fill.r_bit : 0;
     plane_bits |= ((green & mask) == mask) ? fill.g_bit : 0;
     plane_bits |= ((blue & mask) == mask)  ? fill.b_bit : 0;
+    std::fill(first_row + bits * columns_, first_row + (bits + 1) * columns_,
+              plane_bits);
+  }
+  FillFromRow(first_row, red | green | blue, Color(r, g, b));
+}
 
-    for (int row = 0; row < double_rows_; ++row) {
-      gpio_bits_t *row_data = ValueAt(row, 0, bits);
-      for (int col = 0; col < columns_; ++col) {
-        *row_data++ = plane_bits;
-      }
+void Framebuffer::FillFromRow(const gpio_bits_t *row_data, uint16_t lit_planes,
+                              const Color &color) {
+  // Planes below the ones shown keep their content.
+  const int first_plane = bitplanes_ - pwm_bits_;
+  const uint16_t kept_planes = (1 << first_plane) - 1;
+  const size_t bytes = (bitplanes_ - first_plane) * columns_ * sizeof(gpio_bits_t);
+  for (int row = 0; row < double_rows_; ++row) {
+    gpio_bits_t *const dest = ValueAt(row, 0, first_plane);
+    if (dest != row_data + first_plane * columns_) {
+      memcpy(dest, row_data + first_plane * columns_, bytes);
     }
+    plane_occupancy_[row] = ((plane_occupancy_[row] & kept_planes)
+                             | (lit_planes & ~kept_planes));
+    planes_changed_[row] = true;
+  }
+
+  if (staging_ != NULL) {
+    std::fill(staging_, staging_ + staging_width_ * staging_height_, color);
+    staging_valid_ = true;
+    staging_dirty_ = false;
   }
 }
 
@@ -711,39 +1266,398 @@ int Framebuffer::width() const { return (*shared_mapper_)->width(); }
 int Framebuffer::height() const { return (*shared_mapper_)->height(); }
 
 void Framebuffer::SetPixel(int x, int y, uint8_t r, uint8_t g, uint8_t b) {
+  if (packed_ != NULL) Unpack();
+  MarkDamaged(x, y, 1);
+  if (staging_ != NULL) {
+    if (x < 0 || y < 0 || x >= staging_width_ || y >= staging_height_) return;
+    staging_[y * staging_width_ + x] = Color(r, g, b);
+    if (deferred_ && staging_valid_) {
+      staging_dirty_ = true;
+      return;
+    }
+  }
+
   const PixelDesignator *designator = (*shared_mapper_)->get(x, y);
   if (designator == NULL) return;
-  const long pos = designator->gpio_word;
-  if (pos < 0) return;  // non-used pixel marker.
+  if (designator->gpio_word < 0) return;  // non-used pixel marker.
+  if (profile_lookup_ != NULL) {
+    EncodeCorrected(x, y, designator, r, g, b);
+    return;
+  }
 
   uint16_t red, green, blue;
   MapColors(r, g, b, &red, &green, &blue);
+  if (dither_active_) DitherColors(x, y, &red, &green, &blue);
 
-  gpio_bits_t *bits = bitplane_buffer_ + pos;
-  const int min_bit_plane = kBitPlanes - pwm_bits_;
-  bits += (columns_ * min_bit_plane);
-  const gpio_bits_t r_bits = designator->r_bit;
-  const gpio_bits_t g_bits = designator->g_bit;
-  const gpio_bits_t b_bits = designator->b_bit;
-  const gpio_bits_t designator_mask = designator->mask;
-  for (uint16_t mask = 1<<min_bit_plane; mask != 1<<kBitPlanes; mask <<=1 ) {
-    gpio_bits_t color_bits = 0;
-    if (red & mask)   color_bits |= r_bits;
-    if (green & mask) color_bits |= g_bits;
-    if (blue & mask)  color_bits |= b_bits;
-    *bits = (*bits & designator_mask) | color_bits;
-    bits += columns_;
+  EncodeCopies(designator, red, green, blue);
+}
+
+inline void Framebuffer::EncodeCopies(const PixelDesignator *designator,
+                                      uint16_t red, uint16_t green,
+                                      uint16_t blue) {
+  const int32_t pos = designator->gpio_word;
+  EncodePixel(bitplane_buffer_ + pos, columns_, bitplanes_ - pwm_bits_,
+              bitplanes_, red, green, blue,
+              designator->r_bit(), designator->g_bit(), designator->b_bit(),
+              designator->mask());
+  MarkChanged(pos, red | green | blue);
+  if ((*shared_mapper_)->copies() > 1) {
+    EncodeMoreCopies(designator, red, green, blue);
+  }
+}
+
+void Framebuffer::EncodeMoreCopies(const PixelDesignator *designator,
+                                   uint16_t red, uint16_t green,
+                                   uint16_t blue) {
+  const int copies = (*shared_mapper_)->copies();
+  const int copy_stride = width() * height();
+  for (int copy = 1; copy < copies; ++copy) {
+    designator += copy_stride;
+    const int32_t pos = designator->gpio_word;
+    if (pos < 0) break;  // No more copies.
+    EncodePixel(bitplane_buffer_ + pos, columns_, bitplanes_ - pwm_bits_,
+                bitplanes_, red, green, blue,
+                designator->r_bit(), designator->g_bit(), designator->b_bit(),
+                designator->mask());
+    MarkChanged(pos, red | green | blue);
+  }
+}
+
+void Framebuffer::EncodeCorrected(int x, int y,
+                                  const PixelDesignator *designator,
+                                  uint8_t r, uint8_t g, uint8_t b) {
+  const int copies = (*shared_mapper_)->copies();
+  const int copy_stride = width() * height();
+  for (int copy = 0; copy < copies; ++copy, designator += copy_stride) {
+    const int32_t pos = designator->gpio_word;
+    if (pos < 0) break;  // No more copies.
+    // Copies might be on panels with another profile.
+    uint16_t red, green, blue;
+    MapColors(r, g, b, designator->profile(), &red, &green, &blue);
+    if (dither_active_) DitherColors(x, y, &red, &green, &blue);
+    EncodePixel(bitplane_buffer_ + pos, columns_, bitplanes_ - pwm_bits_,
+                bitplanes_, red, green, blue,
+                designator->r_bit(), designator->g_bit(), designator->b_bit(),
+                designator->mask());
+    MarkChanged(pos, red | green | blue);
   }
 }
 
 void Framebuffer::SetPixels(int x, int y, int width, int height, Color *colors) {
-  for (int iy = 0; iy < height; ++iy) {
-    for (int ix = 0; ix < width; ++ix) {
-      SetPixel(x + ix, y + iy, colors->r, colors->g, colors->b);
-      ++colors;
+  if (packed_ != NULL) Unpack();
+  // Clip to the visible area; SetPixelSpan() expects valid coordinates.
+  const int x_start = std::max(x, 0);
+  const int x_end = std::min(x + width, this->width());
+  const int y_start = std::max(y, 0);
+  const int y_end = std::min(y + height, this->height());
+  if (x_start >= x_end) return;
+  const bool encode_later = (staging_ != NULL && deferred_ && staging_valid_);
+  for (int iy = y_start; iy < y_end; ++iy) {
+    const Color *row = colors + (iy - y) * width + (x_start - x);
+    MarkDamaged(x_start, iy, x_end - x_start);
+    if (staging_ != NULL) {
+      memcpy(staging_ + iy * staging_width_ + x_start, row,
+             sizeof(Color) * (x_end - x_start));
+    }
+    if (!encode_later) {
+      SetPixelSpan(x_start, iy, x_end - x_start, row);
+    }
+  }
+  if (encode_later && y_start < y_end) staging_dirty_ = true;
+}
+
+void Framebuffer::SetPixelsToColor(const int *offsets, int count,
+                                   uint8_t r, uint8_t g, uint8_t b) {
+  if (packed_ != NULL) Unpack();
+  const int width = this->width();
+  const int pixels = width * height();
+  const bool encode_later = (staging_ != NULL && deferred_ && staging_valid_);
+  const PixelDesignator *const designators = (*shared_mapper_)->get(0, 0);
+  uint16_t mapped_red, mapped_green, mapped_blue;
+  MapColors(r, g, b, &mapped_red, &mapped_green, &mapped_blue);
+  const Color color(r, g, b);
+  for (int i = 0; i < count; ++i) {
+    const int offset = offsets[i];
+    if (offset < 0 || offset >= pixels) continue;
+    if (!damage_.empty()) MarkDamaged(offset % width, offset / width, 1);
+    if (staging_ != NULL) {
+      staging_[offset] = color;  // Same size as the visible area.
+      if (encode_later) continue;
+    }
+    const PixelDesignator *const designator = designators + offset;
+    if (designator->gpio_word < 0) continue;
+    if (profile_lookup_ != NULL) {
+      EncodeCorrected(offset % width, offset / width, designator, r, g, b);
+      continue;
+    }
+    uint16_t red = mapped_red, green = mapped_green, blue = mapped_blue;
+    if (dither_active_) {
+      DitherColors(offset % width, offset / width, &red, &green, &blue);
+    }
+    EncodeCopies(designator, red, green, blue);
+  }
+  if (encode_later && count > 0) staging_dirty_ = true;
+}
+
+void Framebuffer::Scroll(int dx, int dy, int x, int y, int width, int height) {
+  if (packed_ != NULL) Unpack();
+  const int x_start = std::max(x, 0);
+  const int x_end = std::min(x + width, this->width());
+  const int y_start = std::max(y, 0);
+  const int y_end = std::min(y + height, this->height());
+  if (x_start >= x_end || y_start >= y_end || (dx == 0 && dy == 0)) return;
+  const int region_width = x_end - x_start;
+  const int region_height = y_end - y_start;
+
+  const bool encode_later = (staging_ != NULL && deferred_ && staging_valid_);
+
+  // Move the rows that remain visible.
+  const int count = region_width - abs(dx);
+  const int moved_rows = region_height - abs(dy);
+  if (count > 0 && moved_rows > 0) {
+    const int dst_x = x_start + std::max(dx, 0);
+    const int src_x = dst_x - dx;
+    const int first_src_y = y_start + std::max(-dy, 0);
+    // Bits can't be moved between pixels with different uniformity
+    // correction profiles, so then the moved pixels are set again. Their
+    // colors are exact with the RGB shadow, which the matrix switches on
+    // for canvases with profiles.
+    const bool set_again = !encode_later && profile_lookup_ != NULL;
+    std::vector<Color> moved;
+    if (set_again) {
+      moved.resize(count * moved_rows);
+      GetPixels(src_x, first_src_y, count, moved_rows, moved.data());
+    }
+    for (int i = 0; i < moved_rows; ++i) {
+      const int dst_y = (dy > 0) ? y_end - 1 - i : y_start + i;
+      const int src_y = dst_y - dy;
+      if (staging_ != NULL) {
+        memmove(staging_ + dst_y * staging_width_ + dst_x,
+                staging_ + src_y * staging_width_ + src_x,
+                sizeof(Color) * count);
+      }
+      MarkDamaged(x_start, dst_y, region_width);
+    }
+    if (encode_later) {
+      staging_dirty_ = true;
+    } else if (set_again) {
+      SetPixels(dst_x, first_src_y + dy, count, moved_rows, moved.data());
+    } else {
+      uint16_t lit_planes = 0;
+      for (int row = 0; row < double_rows_; ++row) {
+        lit_planes |= plane_occupancy_[row];
+      }
+      ApplyMoves((*shared_mapper_)->GetScrollMoves(dx, dy, x_start, y_start,
+                                                   region_width,
+                                                   region_height),
+                 lit_planes);
+    }
+  }
+
+  // Black where nothing moved in.
+  std::vector<Color> black(region_width);
+  for (int row = y_start; row < y_end; ++row) {
+    const bool whole_row = (count <= 0 || row < y_start + dy
+                            || row >= y_end + dy);
+    if (whole_row) {
+      SetPixels(x_start, row, region_width, 1, black.data());
+    } else if (dx > 0) {
+      SetPixels(x_start, row, dx, 1, black.data());
+    } else if (dx < 0) {
+      SetPixels(x_end + dx, row, -dx, 1, black.data());
+    }
+  }
+}
+
+void Framebuffer::ApplyMoves(
+  const std::vector<PixelDesignatorMap::WordMove> &moves,
+  uint16_t lit_planes) {
+  gpio_bits_t moved[PixelDesignatorMap::kMaxMoveRun];
+  for (size_t m = 0; m < moves.size(); ++m) {
+    const PixelDesignatorMap::WordMove &move = moves[m];
+    MarkChanged(move.to, lit_planes);
+    gpio_bits_t *const to = bitplane_buffer_ + move.to;
+    const gpio_bits_t bits = move.bits;
+    const gpio_bits_t keep = ~bits;
+    if (move.count > 0) {
+      // Source words are read first, as they might overlap.
+      const int count = move.count;
+      for (int b = 0; b < bitplanes_; ++b) {
+        const int offset = b * columns_;
+        memcpy(moved, bitplane_buffer_ + move.from + offset,
+               count * sizeof(gpio_bits_t));
+        for (int k = 0; k < count; ++k) {
+          to[offset + k] = (to[offset + k] & keep) | (moved[k] & bits);
+        }
+      }
+    } else if (move.from >= 0) {
+      // Different color bits, e.g. moving between the upper and the lower
+      // half of a panel.
+      const gpio_bits_t *const from = bitplane_buffer_ + move.from;
+      for (int b = 0; b < bitplanes_; ++b) {
+        const gpio_bits_t word = from[b * columns_];
+        gpio_bits_t set = 0;
+        if (word & move.src.r_bit()) set |= move.dst.r_bit();
+        if (word & move.src.g_bit()) set |= move.dst.g_bit();
+        if (word & move.src.b_bit()) set |= move.dst.b_bit();
+        to[b * columns_] = (to[b * columns_] & keep) | set;
+      }
+    } else {
+      // Source not shown: black.
+      const uint16_t black = color_lookup_[0];
+      for (int b = 0; b < bitplanes_; ++b) {
+        to[b * columns_] = ((to[b * columns_] & keep)
+                            | ((black & (1 << b)) ? bits : 0));
+      }
+    }
+  }
+}
+
+// A horizontal run of pixels is first color-mapped as a whole, then written
+// bitplane by bitplane. Neighboring pixels of a row typically are neighbors in
+// the bitplane as well; such runs are handed to the (vectorized) encode
+// kernel, all other pixels are encoded one by one.
+void Framebuffer::SetPixelSpan(int x, int y, int count, const Color *colors) {
+  const PixelDesignator *const designators = (*shared_mapper_)->get(x, y);
+  const int copies = (*shared_mapper_)->copies();
+  const int copy_stride = width() * height();
+  const PixelDesignator *d[kSpanChunk];
+  uint16_t red[kSpanChunk], green[kSpanChunk], blue[kSpanChunk];
+  const bool corrected = profile_lookup_ != NULL;
+  for (int start = 0; start < count; start += kSpanChunk) {
+    const int n = std::min(kSpanChunk, count - start);
+    for (int i = 0; i < n; ++i) {
+      d[i] = designators + start + i;
+    }
+    // Copies of a row typically are a row of words as well. With
+    // uniformity correction, each copy is mapped with its own profiles.
+    for (int copy = 0; copy < copies; ++copy) {
+      if (copy > 0) {
+        for (int i = 0; i < n; ++i) d[i] += copy_stride;
+      }
+      if (copy == 0 || corrected) {
+        const Color *const c = colors + start;
+        if (corrected) {
+          for (int i = 0; i < n; ++i) {
+            MapColors(c[i].r, c[i].g, c[i].b, d[i]->profile(),
+                      &red[i], &green[i], &blue[i]);
+          }
+        } else {
+          for (int i = 0; i < n; ++i) {
+            MapColors(c[i].r, c[i].g, c[i].b, &red[i], &green[i], &blue[i]);
+          }
+        }
+        if (dither_active_) DitherRow(x + start, y, red, green, blue, n);
+      }
+      EncodeDesignated(d, red, green, blue, n);
+    }
+  }
+}
+
+void Framebuffer::EncodeDesignated(const PixelDesignator *const *d,
+                                   const uint16_t *red, const uint16_t *green,
+                                   const uint16_t *blue, int count) const {
+  const int min_bit_plane = bitplanes_ - pwm_bits_;
+  const EncodeRunFunction encode_run = GetEncodeKernel().encode_run;
+  int i = 0;
+  while (i < count) {
+    const PixelDesignator &first = *d[i];
+    if (first.gpio_word < 0) {  // non-used pixel marker.
+      ++i;
+      continue;
+    }
+    // Find the run of pixels with consecutive words and the same bits.
+    int run_end = i + 1;
+    while (run_end < count
+           && d[run_end]->gpio_word == d[run_end - 1]->gpio_word + 1
+           && d[run_end]->SameColorBits(first)) {
+      ++run_end;
+    }
+    gpio_bits_t *const words = bitplane_buffer_ + first.gpio_word;
+    uint16_t planes = 0;
+    for (int k = i; k < run_end; ++k) {
+      planes |= red[k] | green[k] | blue[k];
+    }
+    MarkChanged(first.gpio_word, planes);
+    if (run_end - i > 1) {
+      encode_run(words, columns_, min_bit_plane, bitplanes_,
+                 red + i, green + i, blue + i, run_end - i,
+                 first.r_bit(), first.g_bit(), first.b_bit());
+    } else {
+      EncodePixel(words, columns_, min_bit_plane, bitplanes_,
+                  red[i], green[i], blue[i],
+                  first.r_bit(), first.g_bit(), first.b_bit(), first.mask());
+    }
+    i = run_end;
+  }
+}
+
+void Framebuffer::EnableStaging(EncodeWorkerPool *pool) {
+  encode_pool_ = pool;
+  ResetStaging();
+}
+
+void Framebuffer::ResetStaging() {
+  if (packed_ != NULL) return;  // Re-created when unpacked.
+  if (encode_pool_ == NULL && !rgb_shadow_) return;
+  if (staging_ == NULL
+      || staging_width_ != width() || staging_height_ != height()) {
+    delete [] staging_;
+    staging_width_ = width();
+    staging_height_ = height();
+    staging_ = new Color[staging_width_ * staging_height_];
+  }
+  staging_valid_ = false;
+  staging_dirty_ = false;
+  if (rgb_shadow_) DecodeToStaging();
+}
+
+void Framebuffer::SetDeferred(bool deferred) {
+  if (!deferred) EncodeStaged();
+  deferred_ = deferred;
+}
+
+void Framebuffer::EncodeStaged() const {
+  if (!staging_dirty_) return;
+  const PixelDesignatorMap::EncodeOrder &order
+    = (*shared_mapper_)->GetEncodeOrder(double_rows_, columns_ * bitplanes_);
+  // Double rows don't share any gpio words, so can be encoded independently.
+  encode_pool_->ParallelFor(double_rows_, [this, &order](int double_row) {
+      EncodeStagedDoubleRow(order, double_row);
+    });
+  staging_dirty_ = false;
+}
+
+void Framebuffer::EncodeStagedDoubleRow(
+  const PixelDesignatorMap::EncodeOrder &order, int double_row) const {
+  const PixelDesignator *const designators = (*shared_mapper_)->get(0, 0);
+  const int width = this->width();
+  const int visible_pixels = width * height();
+  const int *const pixels = order.pixels.data() + order.row_start[double_row];
+  const int count = (order.row_start[double_row + 1]
+                     - order.row_start[double_row]);
+  const PixelDesignator *d[kSpanChunk];
+  uint16_t red[kSpanChunk], green[kSpanChunk], blue[kSpanChunk];
+  for (int start = 0; start < count; start += kSpanChunk) {
+    const int n = std::min(kSpanChunk, count - start);
+    for (int i = 0; i < n; ++i) {
+      const int index = pixels[start + i];
+      const int pixel = (index < visible_pixels) ? index
+        : index % visible_pixels;  // A copy.
+      const Color &c = staging_[pixel];
+      MapColors(c.r, c.g, c.b, designators[index].profile(),
+                &red[i], &green[i], &blue[i]);
+      if (dither_active_) {
+        DitherColors(pixel % width, pixel / width, &red[i], &green[i],
+                     &blue[i]);
+      }
+      d[i] = designators + index;
     }
+    EncodeDesignated(d, red, green, blue, n);
   }
+  FindIdenticalPlanes(double_row);
 }
+
 // Strange LED-mappings such as RBG or so are handled here.
 gpio_bits_t Framebuffer::GetGpioFromLedSequence(char col,
                                                 const char *led_sequence,
@@ -770,158 +1684,870 @@ void Framebuffer::InitDefaultDesignator(int x, int y, const char *seq,
   const struct HardwareMapping &h = *hardware_mapping_;
   gpio_bits_t *bits = ValueAt(y % double_rows_, x, 0);
   d->gpio_word = bits - bitplane_buffer_;
-  d->r_bit = d->g_bit = d->b_bit = 0;
+  gpio_bits_t r_bit = 0, g_bit = 0, b_bit = 0;
   if (y < rows_) {
     if (y < double_rows_) {
-      d->r_bit = GetGpioFromLedSequence('R', seq, h.p0_r1, h.p0_g1, h.p0_b1);
-      d->g_bit = GetGpioFromLedSequence('G', seq, h.p0_r1, h.p0_g1, h.p0_b1);
-      d->b_bit = GetGpioFromLedSequence('B', seq, h.p0_r1, h.p0_g1, h.p0_b1);
+      r_bit = GetGpioFromLedSequence('R', seq, h.p0_r1, h.p0_g1, h.p0_b1);
+      g_bit = GetGpioFromLedSequence('G', seq, h.p0_r1, h.p0_g1, h.p0_b1);
+      b_bit = GetGpioFromLedSequence('B', seq, h.p0_r1, h.p0_g1, h.p0_b1);
     } else {
-      d->r_bit = GetGpioFromLedSequence('R', seq, h.p0_r2, h.p0_g2, h.p0_b2);
-      d->g_bit = GetGpioFromLedSequence('G', seq, h.p0_r2, h.p0_g2, h.p0_b2);
-      d->b_bit = GetGpioFromLedSequence('B', seq, h.p0_r2, h.p0_g2, h.p0_b2);
+      r_bit = GetGpioFromLedSequence('R', seq, h.p0_r2, h.p0_g2, h.p0_b2);
+      g_bit = GetGpioFromLedSequence('G', seq, h.p0_r2, h.p0_g2, h.p0_b2);
+      b_bit = GetGpioFromLedSequence('B', seq, h.p0_r2, h.p0_g2, h.p0_b2);
     }
   }
   else if (y >= rows_ && y < 2 * rows_) {
     if (y - rows_ < double_rows_) {
-      d->r_bit = GetGpioFromLedSequence('R', seq, h.p1_r1, h.p1_g1, h.p1_b1);
-      d->g_bit = GetGpioFromLedSequence('G', seq, h.p1_r1, h.p1_g1, h.p1_b1);
-      d->b_bit = GetGpioFromLedSequence('B', seq, h.p1_r1, h.p1_g1, h.p1_b1);
+      r_bit = GetGpioFromLedSequence('R', seq, h.p1_r1, h.p1_g1, h.p1_b1);
+      g_bit = GetGpioFromLedSequence('G', seq, h.p1_r1, h.p1_g1, h.p1_b1);
+      b_bit = GetGpioFromLedSequence('B', seq, h.p1_r1, h.p1_g1, h.p1_b1);
     } else {
-      d->r_bit = GetGpioFromLedSequence('R', seq, h.p1_r2, h.p1_g2, h.p1_b2);
-      d->g_bit = GetGpioFromLedSequence('G', seq, h.p1_r2, h.p1_g2, h.p1_b2);
-      d->b_bit = GetGpioFromLedSequence('B', seq, h.p1_r2, h.p1_g2, h.p1_b2);
+      r_bit = GetGpioFromLedSequence('R', seq, h.p1_r2, h.p1_g2, h.p1_b2);
+      g_bit = GetGpioFromLedSequence('G', seq, h.p1_r2, h.p1_g2, h.p1_b2);
+      b_bit = GetGpioFromLedSequence('B', seq, h.p1_r2, h.p1_g2, h.p1_b2);
     }
   }
   else if (y >= 2*rows_ && y < 3 * rows_) {
     if (y - 2*rows_ < double_rows_) {
-      d->r_bit = GetGpioFromLedSequence('R', seq, h.p2_r1, h.p2_g1, h.p2_b1);
-      d->g_bit = GetGpioFromLedSequence('G', seq, h.p2_r1, h.p2_g1, h.p2_b1);
-      d->b_bit = GetGpioFromLedSequence('B', seq, h.p2_r1, h.p2_g1, h.p2_b1);
+      r_bit = GetGpioFromLedSequence('R', seq, h.p2_r1, h.p2_g1, h.p2_b1);
+      g_bit = GetGpioFromLedSequence('G', seq, h.p2_r1, h.p2_g1, h.p2_b1);
+      b_bit = GetGpioFromLedSequence('B', seq, h.p2_r1, h.p2_g1, h.p2_b1);
     } else {
-      d->r_bit = GetGpioFromLedSequence('R', seq, h.p2_r2, h.p2_g2, h.p2_b2);
-      d->g_bit = GetGpioFromLedSequence('G', seq, h.p2_r2, h.p2_g2, h.p2_b2);
-      d->b_bit = GetGpioFromLedSequence('B', seq, h.p2_r2, h.p2_g2, h.p2_b2);
+      r_bit = GetGpioFromLedSequence('R', seq, h.p2_r2, h.p2_g2, h.p2_b2);
+      g_bit = GetGpioFromLedSequence('G', seq, h.p2_r2, h.p2_g2, h.p2_b2);
+      b_bit = GetGpioFromLedSequence('B', seq, h.p2_r2, h.p2_g2, h.p2_b2);
     }
   }
   else if (y >= 3*rows_ && y < 4 * rows_) {
     if (y - 3*rows_ < double_rows_) {
-      d->r_bit = GetGpioFromLedSequence('R', seq, h.p3_r1, h.p3_g1, h.p3_b1);
-      d->g_bit = GetGpioFromLedSequence('G', seq, h.p3_r1, h.p3_g1, h.p3_b1);
-      d->b_bit = GetGpioFromLedSequence('B', seq, h.p3_r1, h.p3_g1, h.p3_b1);
+      r_bit = GetGpioFromLedSequence('R', seq, h.p3_r1, h.p3_g1, h.p3_b1);
+      g_bit = GetGpioFromLedSequence('G', seq, h.p3_r1, h.p3_g1, h.p3_b1);
+      b_bit = GetGpioFromLedSequence('B', seq, h.p3_r1, h.p3_g1, h.p3_b1);
     } else {
-      d->r_bit = GetGpioFromLedSequence('R', seq, h.p3_r2, h.p3_g2, h.p3_b2);
-      d->g_bit = GetGpioFromLedSequence('G', seq, h.p3_r2, h.p3_g2, h.p3_b2);
-      d->b_bit = GetGpioFromLedSequence('B', seq, h.p3_r2, h.p3_g2, h.p3_b2);
+      r_bit = GetGpioFromLedSequence('R', seq, h.p3_r2, h.p3_g2, h.p3_b2);
+      g_bit = GetGpioFromLedSequence('G', seq, h.p3_r2, h.p3_g2, h.p3_b2);
+      b_bit = GetGpioFromLedSequence('B', seq, h.p3_r2, h.p3_g2, h.p3_b2);
     }
   }
   else if (y >= 4*rows_ && y < 5 * rows_){
     if (y - 4*rows_ < double_rows_) {
-      d->r_bit = GetGpioFromLedSequence('R', seq, h.p4_r1, h.p4_g1, h.p4_b1);
-      d->g_bit = GetGpioFromLedSequence('G', seq, h.p4_r1, h.p4_g1, h.p4_b1);
-      d->b_bit = GetGpioFromLedSequence('B', seq, h.p4_r1, h.p4_g1, h.p4_b1);
+      r_bit = GetGpioFromLedSequence('R', seq, h.p4_r1, h.p4_g1, h.p4_b1);
+      g_bit = GetGpioFromLedSequence('G', seq, h.p4_r1, h.p4_g1, h.p4_b1);
+      b_bit = GetGpioFromLedSequence('B', seq, h.p4_r1, h.p4_g1, h.p4_b1);
     } else {
-      d->r_bit = GetGpioFromLedSequence('R', seq, h.p4_r2, h.p4_g2, h.p4_b2);
-      d->g_bit = GetGpioFromLedSequence('G', seq, h.p4_r2, h.p4_g2, h.p4_b2);
-      d->b_bit = GetGpioFromLedSequence('B', seq, h.p4_r2, h.p4_g2, h.p4_b2);
+      r_bit = GetGpioFromLedSequence('R', seq, h.p4_r2, h.p4_g2, h.p4_b2);
+      g_bit = GetGpioFromLedSequence('G', seq, h.p4_r2, h.p4_g2, h.p4_b2);
+      b_bit = GetGpioFromLedSequence('B', seq, h.p4_r2, h.p4_g2, h.p4_b2);
     }
 
   }
   else {
     if (y - 5*rows_ < double_rows_) {
-      d->r_bit = GetGpioFromLedSequence('R', seq, h.p5_r1, h.p5_g1, h.p5_b1);
-      d->g_bit = GetGpioFromLedSequence('G', seq, h.p5_r1, h.p5_g1, h.p5_b1);
-      d->b_bit = GetGpioFromLedSequence('B', seq, h.p5_r1, h.p5_g1, h.p5_b1);
+      r_bit = GetGpioFromLedSequence('R', seq, h.p5_r1, h.p5_g1, h.p5_b1);
+      g_bit = GetGpioFromLedSequence('G', seq, h.p5_r1, h.p5_g1, h.p5_b1);
+      b_bit = GetGpioFromLedSequence('B', seq, h.p5_r1, h.p5_g1, h.p5_b1);
     } else {
-      d->r_bit = GetGpioFromLedSequence('R', seq, h.p5_r2, h.p5_g2, h.p5_b2);
-      d->g_bit = GetGpioFromLedSequence('G', seq, h.p5_r2, h.p5_g2, h.p5_b2);
-      d->b_bit = GetGpioFromLedSequence('B', seq, h.p5_r2, h.p5_g2, h.p5_b2);
+      r_bit = GetGpioFromLedSequence('R', seq, h.p5_r2, h.p5_g2, h.p5_b2);
+      g_bit = GetGpioFromLedSequence('G', seq, h.p5_r2, h.p5_g2, h.p5_b2);
+      b_bit = GetGpioFromLedSequence('B', seq, h.p5_r2, h.p5_g2, h.p5_b2);
     }
   }
 
-  d->mask = ~(d->r_bit | d->g_bit | d->b_bit);
+  d->SetColorBits(r_bit, g_bit, b_bit);
 }
 
 void Framebuffer::Serialize(const char **data, size_t *len) const {
+  if (packed_ != NULL) {
+    *data = reinterpret_cast<const char*>(packed_);
+    *len = PackedSize();
+    return;
+  }
+  EncodeStaged();
   *data = reinterpret_cast<const char*>(bitplane_buffer_);
   *len = buffer_size_;
 }
 
 bool Framebuffer::Deserialize(const char *data, size_t len) {
-  if (len != buffer_size_) return false;
-  memcpy(bitplane_buffer_, data, len);
+  if (len == buffer_size_) {
+    if (packed_ != NULL) Unpack();
+    memcpy(bitplane_buffer_, data, len);
+  } else if (PackedWordBytes() < (int)sizeof(gpio_bits_t)
+             && len == PackedSize()) {
+    if (packed_ == NULL) {
+      packed_ = new uint8_t[PackedSize()];
+      ReleaseUnpacked();
+    }
+    memcpy(packed_, data, len);
+  } else {
+    return false;
+  }
+  RecalculateOccupancy();
+  memset(planes_changed_, true, sizeof(planes_changed_));
+  MarkAllDamaged();
+  // Telling the colors from the bitplanes is slow; unless needed for
+  // reading back, draw directly until the next Clear() or Fill().
+  staging_valid_ = false;
+  staging_dirty_ = false;
+  if (rgb_shadow_ && staging_ != NULL) DecodeToStaging();
   return true;
 }
 
 void Framebuffer::CopyFrom(const Framebuffer *other) {
   if (other == this) return;
-  memcpy(bitplane_buffer_, other->bitplane_buffer_, buffer_size_);
+  if (packed_ != NULL) Unpack();
+  MarkAllDamaged();
+  other->EncodeStaged();
+  if (other->packed_ != NULL) {
+    other->ExpandPacked(bitplane_buffer_);
+  } else {
+    memcpy(bitplane_buffer_, other->bitplane_buffer_, buffer_size_);
+  }
+  memcpy(plane_occupancy_, other->plane_occupancy_, sizeof(plane_occupancy_));
+  memcpy(identical_planes_, other->identical_planes_,
+         sizeof(identical_planes_));
+  memcpy(planes_changed_, other->planes_changed_, sizeof(planes_changed_));
+  if (staging_ != NULL) {
+    staging_valid_ = (other->staging_ != NULL && other->staging_valid_
+                      && other->staging_width_ == staging_width_
+                      && other->staging_height_ == staging_height_);
+    if (staging_valid_) {
+      memcpy(staging_, other->staging_,
+             sizeof(Color) * staging_width_ * staging_height_);
+    }
+    staging_dirty_ = false;
+  }
 }
 
-void Framebuffer::DumpToMatrix(GPIO *io, int pwm_low_bit) {
-  const struct HardwareMapping &h = *hardware_mapping_;
-  gpio_bits_t color_clk_mask = 0;  // Mask of bits while clocking in.
-  color_clk_mask |= h.p0_r1 | h.p0_g1 | h.p0_b1 | h.p0_r2 | h.p0_g2 | h.p0_b2;
-  if (parallel_ >= 2) {
-    color_clk_mask |= h.p1_r1 | h.p1_g1 | h.p1_b1 | h.p1_r2 | h.p1_g2 | h.p1_b2;
+void Framebuffer::set_rgb_shadow(bool on) {
+  if (on == rgb_shadow_) return;
+  rgb_shadow_ = on;
+  if (on) {
+    if (staging_ == NULL) {
+      ResetStaging();
+    } else if (!staging_valid_) {
+      DecodeToStaging();
+    }
+  } else if (encode_pool_ == NULL) {
+    delete [] staging_;
+    staging_ = NULL;
+    staging_valid_ = false;
+  }
+}
+
+void Framebuffer::GetPixel(int x, int y,
+                           uint8_t *red, uint8_t *green, uint8_t *blue) const {
+  Color c;
+  GetPixels(x, y, 1, 1, &c);
+  *red = c.r;
+  *green = c.g;
+  *blue = c.b;
+}
+
+void Framebuffer::GetPixels(int x, int y, int width, int height,
+                            Color *colors) const {
+  const int visible_width = this->width();
+  const int visible_height = this->height();
+  const bool staged = (staging_ != NULL && staging_valid_);
+  for (int iy = y; iy < y + height; ++iy) {
+    if (iy < 0 || iy >= visible_height) {
+      std::fill(colors, colors + width, Color());
+      colors += width;
+      continue;
+    }
+    for (int ix = x; ix < x + width; ++ix) {
+      if (ix < 0 || ix >= visible_width) {
+        *colors++ = Color();
+      } else if (staged) {
+        *colors++ = staging_[iy * staging_width_ + ix];
+      } else {
+        *colors++ = DecodePixel(ix, iy);
+      }
+    }
+  }
+}
+
+inline gpio_bits_t Framebuffer::WordAt(int index) const {
+  if (packed_ == NULL) return bitplane_buffer_[index];
+  switch (PackedWordBytes()) {
+  case 1: return UnpackWord(packed_[index], parallel_);
+  case 2: return UnpackWord(reinterpret_cast<const uint16_t*>(packed_)[index],
+                            parallel_);
+  default: return UnpackWord(reinterpret_cast<const uint32_t*>(packed_)[index],
+                             parallel_);
+  }
+}
+
+Color Framebuffer::DecodePixel(int x, int y) const {
+  const PixelDesignator *designator = (*shared_mapper_)->get(x, y);
+  if (designator == NULL || designator->gpio_word < 0) return Color();
+  uint16_t red = 0, green = 0, blue = 0;
+  for (int b = bitplanes_ - pwm_bits_; b < bitplanes_; ++b) {
+    const gpio_bits_t word = WordAt(designator->gpio_word + b * columns_);
+    if (word & designator->r_bit()) red |= 1 << b;
+    if (word & designator->g_bit()) green |= 1 << b;
+    if (word & designator->b_bit()) blue |= 1 << b;
+  }
+  const uint8_t profile = designator->profile();
+  return Color(UnmapColor(red, ColorTable(profile, 0)),
+               UnmapColor(green, ColorTable(profile, 1)),
+               UnmapColor(blue, ColorTable(profile, 2)));
+}
+
+uint8_t Framebuffer::UnmapColor(uint16_t value,
+                                const uint16_t *lookup) const {
+  // Planes not shown are not encoded. Color tables are monotonic, so
+  // binary search for the closest value.
+  const uint16_t shown = (((1 << bitplanes_) - 1)
+                          & ~((1 << (bitplanes_ - pwm_bits_)) - 1));
+  const uint16_t invert = inverse_color_ ? 0xffff : 0;
+  value = (value ^ invert) & shown;
+  int lo = 0, hi = 255;
+  while (lo < hi) {
+    const int mid = (lo + hi) / 2;
+    if (((lookup[mid] ^ invert) & shown) < value)
+      lo = mid + 1;
+    else
+      hi = mid;
   }
-  if (parallel_ >= 3) {
-    color_clk_mask |= h.p2_r1 | h.p2_g1 | h.p2_b1 | h.p2_r2 | h.p2_g2 | h.p2_b2;
+  if (lo > 0 && (value - ((lookup[lo - 1] ^ invert) & shown)
+                 < ((lookup[lo] ^ invert) & shown) - value)) {
+    --lo;
   }
-  if (parallel_ >= 4) {
-    color_clk_mask |= h.p3_r1 | h.p3_g1 | h.p3_b1 | h.p3_r2 | h.p3_g2 | h.p3_b2;
+  return lo;
+}
+
+void Framebuffer::DecodeToStaging() {
+  for (int y = 0; y < staging_height_; ++y) {
+    for (int x = 0; x < staging_width_; ++x) {
+      staging_[y * staging_width_ + x] = DecodePixel(x, y);
+    }
   }
-  if (parallel_ >= 5) {
-    color_clk_mask |= h.p4_r1 | h.p4_g1 | h.p4_b1 | h.p4_r2 | h.p4_g2 | h.p4_b2;
+  staging_valid_ = true;
+  staging_dirty_ = false;
+}
+
+void Framebuffer::UpdateFrom(Framebuffer *other) {
+  if (other == this) return;
+  const int height = this->height();
+  const bool incremental = (synced_with_ == other
+                            && other->synced_with_ == this
+                            && !fully_damaged_ && !other->fully_damaged_
+                            && packed_ == NULL && other->packed_ == NULL
+                            && (int)damage_.size() == height
+                            && (int)other->damage_.size() == height);
+  if (incremental) {
+    other->EncodeStaged();
+    CopyDamaged(other, this);   // Drawn on while on screen.
+    CopyDamaged(other, other);
+    memcpy(plane_occupancy_, other->plane_occupancy_,
+           sizeof(plane_occupancy_));
+    memcpy(identical_planes_, other->identical_planes_,
+           sizeof(identical_planes_));
+    memcpy(planes_changed_, other->planes_changed_, sizeof(planes_changed_));
+  } else {
+    CopyFrom(other);
   }
-  if (parallel_ >= 6) {
-    color_clk_mask |= h.p5_r1 | h.p5_g1 | h.p5_b1 | h.p5_r2 | h.p5_g2 | h.p5_b2;
+  ResetDamage();
+  other->ResetDamage();
+  synced_with_ = other;
+  other->synced_with_ = this;
+}
+
+void Framebuffer::CopyDamaged(const Framebuffer *other,
+                              const Framebuffer *damaged) {
+  const int width = this->width();
+  const bool copy_staging = (staging_ != NULL && staging_valid_
+                             && staging_width_ == width
+                             && staging_height_ == height());
+  const bool other_staged = (other->staging_ != NULL && other->staging_valid_
+                             && other->staging_width_ == width
+                             && other->staging_height_ == height());
+  for (int y = damaged->damage_y0_; y < damaged->damage_y1_; ++y) {
+    const DamageSpan &span = damaged->damage_[y];
+    const int x0 = std::max(span.x0, 0);
+    const int x1 = std::min(span.x1, width);
+    if (x0 >= x1) continue;
+    for (int copy = 0; copy < (*shared_mapper_)->copies(); ++copy) {
+      const PixelDesignator *designator = (*shared_mapper_)->get(x0, y, copy);
+      for (int x = x0; x < x1; ++x, ++designator) {
+        const int32_t pos = designator->gpio_word;
+        if (pos < 0) continue;
+        for (int b = 0; b < bitplanes_; ++b) {
+          bitplane_buffer_[pos + b * columns_]
+            = other->bitplane_buffer_[pos + b * columns_];
+        }
+      }
+    }
+    if (!copy_staging) continue;
+    Color *staged = staging_ + y * staging_width_;
+    if (other_staged) {
+      memcpy(staged + x0, other->staging_ + y * staging_width_ + x0,
+             sizeof(Color) * (x1 - x0));
+    } else {
+      for (int x = x0; x < x1; ++x) staged[x] = other->DecodePixel(x, y);
+    }
   }
+}
 
-  color_clk_mask |= h.clock;
+void Framebuffer::ResetDamage() {
+  const int height = this->height();
+  const DamageSpan empty = { INT_MAX, INT_MIN };
+  if ((int)damage_.size() != height) {
+    damage_.assign(height, empty);
+  } else if (damage_y0_ < damage_y1_) {
+    std::fill(damage_.begin() + damage_y0_, damage_.begin() + damage_y1_,
+              empty);
+  }
+  damage_y0_ = height;
+  damage_y1_ = 0;
+  fully_damaged_ = false;
+}
 
-  // Depending if we do dithering, we might not always show the lowest bits.
-  const int start_bit = std::max(pwm_low_bit, kBitPlanes - pwm_bits_);
-
-  const uint8_t half_double = double_rows_/2;
-  for (uint8_t row_loop = 0; row_loop < double_rows_; ++row_loop) {
-    uint8_t d_row;
-    switch (scan_mode_) {
-    case 0:  // progressive
-    default:
-      d_row = row_loop;
-      break;
+void Framebuffer::RecalculateOccupancy() {
+  const size_t plane_bytes = PlaneBytes();
+  for (int row = 0; row < double_rows_; ++row) {
+    uint16_t planes = 0;
+    for (int b = 0; b < bitplanes_; ++b) {
+      const uint8_t *plane_data = PlaneData(row, b);
+      uint8_t any_bits = 0;
+      for (size_t i = 0; i < plane_bytes; ++i) {
+        any_bits |= plane_data[i];
+      }
+      if (any_bits) planes |= 1 << b;
+    }
+    plane_occupancy_[row] = planes;
+  }
+}
+
+void Framebuffer::FindIdenticalPlanes() const {
+  for (int row = 0; row < double_rows_; ++row) {
+    FindIdenticalPlanes(row);
+  }
+}
+
+void Framebuffer::FindIdenticalPlanes(int double_row) const {
+  if (!merge_identical_planes_ || !planes_changed_[double_row]) return;
+  const size_t plane_bytes = PlaneBytes();
+  uint16_t identical = 0;
+  for (int b = 1; b < bitplanes_; ++b) {
+    if (memcmp(PlaneData(double_row, b - 1), PlaneData(double_row, b),
+               plane_bytes) == 0) {
+      identical |= 1 << b;
+    }
+  }
+  identical_planes_[double_row] = identical;
+  planes_changed_[double_row] = false;
+}
+
+int Framebuffer::PackedWordBytes() const {
+  // 6 color bits per parallel chain.
+  switch (parallel_) {
+  case 1: return 1;
+  case 2: return 2;
+  case 3: case 4: case 5: return 4;
+  default: return 8;
+  }
+}
+
+size_t Framebuffer::PackedSize() const {
+  return double_rows_ * columns_ * bitplanes_ * PackedWordBytes();
+}
+
+size_t Framebuffer::PlaneBytes() const {
+  return columns_ * (packed_ != NULL ? PackedWordBytes() : sizeof(gpio_bits_t));
+}
+
+const uint8_t *Framebuffer::PlaneData(int double_row, int bit) const {
+  const uint8_t *data = (packed_ != NULL)
+    ? packed_
+    : reinterpret_cast<const uint8_t*>(bitplane_buffer_);
+  return data + (double_row * bitplanes_ + bit) * PlaneBytes();
+}
+
+template <typename T> void Framebuffer::PackWords(T *out) const {
+  const int words = double_rows_ * columns_ * bitplanes_;
+  for (int i = 0; i < words; ++i) {
+    const gpio_bits_t word = bitplane_buffer_[i];
+    T packed = 0;
+    if (word) {
+      for (int chain = 0; chain < parallel_; ++chain) {
+        for (int c = 0; c < 6; ++c) {
+          if (word & unpack_table_[chain][1 << c])
+            packed |= (T)1 << (6 * chain + c);
+        }
+      }
+    }
+    out[i] = packed;
+  }
+}
+
+template <typename T>
+void Framebuffer::UnpackWords(const T *in, gpio_bits_t *out) const {
+  const int words = double_rows_ * columns_ * bitplanes_;
+  for (int i = 0; i < words; ++i) {
+    out[i] = UnpackWord(in[i], parallel_);
+  }
+}
+
+template <typename T>
+inline gpio_bits_t Framebuffer::UnpackWord(T packed, int chains) {
+  gpio_bits_t word = unpack_table_[0][packed & 0x3f];
+  for (int chain = 1; chain < chains; ++chain) {
+    word |= unpack_table_[chain][(packed >> (6 * chain)) & 0x3f];
+  }
+  return word;
+}
+
+bool Framebuffer::Pack() {
+  if (packed_ != NULL) return true;
+  if (PackedWordBytes() >= (int)sizeof(gpio_bits_t)) return false;
+  EncodeStaged();
+  FindIdenticalPlanes();  // Can't change anymore, so do it now.
+  packed_ = new uint8_t[PackedSize()];
+  switch (PackedWordBytes()) {
+  case 1: PackWords(reinterpret_cast<uint8_t*>(packed_)); break;
+  case 2: PackWords(reinterpret_cast<uint16_t*>(packed_)); break;
+  case 4: PackWords(reinterpret_cast<uint32_t*>(packed_)); break;
+  }
+  ReleaseUnpacked();
+  return true;
+}
+
+gpio_bits_t *Framebuffer::AllocateBitplanes() {
+  if (arena_ == NULL)
+    return new gpio_bits_t[double_rows_ * columns_ * bitplanes_];
+  return static_cast<gpio_bits_t*>(arena_->Allocate());
+}
+
+void Framebuffer::FreeBitplanes() {
+  if (arena_ == NULL)
+    delete [] bitplane_buffer_;
+  else if (bitplane_buffer_ != NULL)
+    arena_->Release(bitplane_buffer_);
+  bitplane_buffer_ = NULL;
+}
+
+void Framebuffer::ReleaseUnpacked() {
+  FreeBitplanes();
+  // Drawing needs to unpack first, so no need for the staging buffer.
+  delete [] staging_;
+  staging_ = NULL;
+  staging_valid_ = false;
+  staging_dirty_ = false;
+}
+
+void Framebuffer::ExpandPacked(gpio_bits_t *out) const {
+  switch (PackedWordBytes()) {
+  case 1: UnpackWords(reinterpret_cast<const uint8_t*>(packed_), out); break;
+  case 2: UnpackWords(reinterpret_cast<const uint16_t*>(packed_), out); break;
+  case 4: UnpackWords(reinterpret_cast<const uint32_t*>(packed_), out); break;
+  }
+}
+
+static void AddStrideRowOrder(int double_rows, int stride,
+                              std::vector<uint8_t> *order) {
+  for (int start = 0; start < stride; ++start) {
+    for (int row = start; row < double_rows; row += stride) {
+      order->push_back(row);
+    }
+  }
+}
+
+/* static */ bool Framebuffer::CreateRowOrder(int rows, int scan_mode,
+                                             const char *scan_order,
+                                             std::vector<uint8_t> *order,
+                                             std::string *err) {
+  const int double_rows = rows / SUB_PANELS_;
+  char buffer[256];
+  order->clear();
+  if (scan_order != NULL && strncmp(scan_order, "stride:", 7) == 0) {
+    char *end;
+    const long stride = strtol(scan_order + 7, &end, 10);
+    if (end == scan_order + 7 || *end != '\0'
+        || stride < 1 || stride > double_rows) {
+      snprintf(buffer, sizeof(buffer),
+               "Invalid scan-order stride (1..%d allowed).\n", double_rows);
+      err->append(buffer);
+      return false;
+    }
+    AddStrideRowOrder(double_rows, stride, order);
+    return true;
+  }
+
+  if (scan_order != NULL) {
+    std::vector<bool> seen(double_rows, false);
+    const char *pos = scan_order;
+    bool valid = true;
+    for (;;) {
+      char *end;
+      const long row = strtol(pos, &end, 10);
+      if (end == pos || row < 0 || row >= double_rows || seen[row]
+          || (*end != ',' && *end != '\0')) {
+        valid = false;
+        break;
+      }
+      seen[row] = true;
+      order->push_back(row);
+      if (*end == '\0') break;
+      pos = end + 1;
+    }
+    if (!valid || (int)order->size() != double_rows) {
+      snprintf(buffer, sizeof(buffer),
+               "scan-order needs to be \"stride:<n>\" or a comma separated "
+               "list of all double rows 0..%d, each once.\n",
+               double_rows - 1);
+      err->append(buffer);
+      return false;
+    }
+    return true;
+  }
+
+  switch (scan_mode) {
+  case 0:  // progressive
+  default:
+    AddStrideRowOrder(double_rows, 1, order);
+    break;
+
+  case 1:  // interlaced
+    AddStrideRowOrder(double_rows, 2, order);
+    break;
+
+  case 2: {  // bit-reversed
+    int bits = 0;
+    while ((1 << bits) < double_rows) ++bits;
+    for (int i = 0; i < (1 << bits); ++i) {
+      int row = 0;
+      for (int b = 0; b < bits; ++b) {
+        if (i & (1 << b)) row |= 1 << (bits - 1 - b);
+      }
+      if (row < double_rows) order->push_back(row);
+    }
+    break;
+  }
+  }
+  return true;
+}
 
-    case 1:  // interlaced
-      d_row = ((row_loop < half_double)
-               ? (row_loop << 1)
-               : ((row_loop - half_double) << 1) + 1);
-    }
-
-    // Rows can't be switched very quickly without ghosting, so we do the
-    // full PWM of one row before switching rows.
-    for (int b = start_bit; b < kBitPlanes; ++b) {
-      gpio_bits_t *row_data = ValueAt(d_row, 0, b);
-      // While the output enable is still on, we can already clock in the next
-      // data.
-      for (int col = 0; col < columns_; ++col) {
-        const gpio_bits_t &out = *row_data++;
-        io->WriteMaskedBits(out, color_clk_mask);  // col + reset clock
-        io->SetBits(h.clock);               // Rising edge: clock color in.
+/* static */ bool Framebuffer::LoadUniformityCorrection(
+  const char *filename, int panel_rows, int panel_cols, int chain,
+  int parallel, UniformityCorrection *correction, std::string *err) {
+  const int width = panel_cols * chain;
+  const int height = panel_rows * parallel;
+  char buffer[1024];
+  correction->profiles.clear();
+  correction->areas.clear();
+  FILE *f = fopen(filename, "r");
+  if (f == NULL) {
+    snprintf(buffer, sizeof(buffer),
+             "Can't open uniformity file %s: %s\n", filename, strerror(errno));
+    err->append(buffer);
+    return false;
+  }
+  std::vector<bool> defined;
+  char line[256];
+  int line_no = 0;
+  const char *problem = NULL;
+  while (problem == NULL && fgets(line, sizeof(line), f) != NULL) {
+    ++line_no;
+    char *const comment = strchr(line, '#');
+    if (comment) *comment = '\0';
+    char keyword[16];
+    int used = 0;
+    if (sscanf(line, " %15s %n", keyword, &used) != 1) continue;  // Empty.
+    const char *const args = line + used;
+    int end = 0;
+    if (strcmp(keyword, "profile") == 0) {
+      int profile;
+      UniformityCorrection::Gains gains;
+      if (sscanf(args, "%d %f %f %f %n", &profile, &gains.red, &gains.green,
+                 &gains.blue, &end) != 4 || args[end] != '\0') {
+        problem = "expected profile <n> <red> <green> <blue>";
+      } else if (profile < 1 || profile > 255) {
+        problem = "profile number needs to be 1..255";
+      } else if (!(gains.red > 0 && gains.red <= 1)
+                 || !(gains.green > 0 && gains.green <= 1)
+                 || !(gains.blue > 0 && gains.blue <= 1)) {
+        problem = "gains need to be larger than 0 and at most 1";
+      } else {
+        if ((int)correction->profiles.size() < profile) {
+          const UniformityCorrection::Gains unity = { 1, 1, 1 };
+          correction->profiles.resize(profile, unity);
+          defined.resize(profile, false);
+        }
+        correction->profiles[profile - 1] = gains;
+        defined[profile - 1] = true;
       }
-      io->ClearBits(color_clk_mask);    // clock back to normal.
+    } else if (strcmp(keyword, "panel") == 0) {
+      int chain_pos, parallel_pos, profile;
+      if (sscanf(args, "%d %d %d %n", &chain_pos, &parallel_pos, &profile,
+                 &end) != 3 || args[end] != '\0') {
+        problem = "expected panel <chain-position> <parallel-chain> <profile>";
+      } else if (chain_pos < 0 || chain_pos >= chain
+                 || parallel_pos < 0 || parallel_pos >= parallel) {
+        problem = "no such panel";
+      } else {
+        const UniformityCorrection::Area area = {
+          chain_pos * panel_cols, parallel_pos * panel_rows,
+          panel_cols, panel_rows, profile };
+        correction->areas.push_back(area);
+      }
+    } else if (strcmp(keyword, "area") == 0) {
+      UniformityCorrection::Area area;
+      if (sscanf(args, "%d %d %d %d %d %n", &area.x, &area.y, &area.width,
+                 &area.height, &area.profile, &end) != 5
+          || args[end] != '\0') {
+        problem = "expected area <x> <y> <width> <height> <profile>";
+      } else if (area.x < 0 || area.y < 0 || area.width < 1 || area.height < 1
+                 || area.x + area.width > width
+                 || area.y + area.height > height) {
+        problem = "area outside of the chains";
+      } else {
+        correction->areas.push_back(area);
+      }
+    } else {
+      problem = "expected profile, panel or area";
+    }
+  }
+  fclose(f);
+  if (problem == NULL) {
+    for (size_t i = 0; i < correction->areas.size(); ++i) {
+      const int profile = correction->areas[i].profile;
+      if (profile < 1 || profile > (int)defined.size()
+          || !defined[profile - 1]) {
+        snprintf(buffer, sizeof(buffer),
+                 "Uniformity file %s uses profile %d, which is not "
+                 "defined.\n", filename, profile);
+        err->append(buffer);
+        return false;
+      }
+    }
+    return true;
+  }
+  snprintf(buffer, sizeof(buffer), "Uniformity file %s:%d: %s.\n",
+           filename, line_no, problem);
+  err->append(buffer);
+  return false;
+}
+
+/* static */ void Framebuffer::InitUniformityProfiles(
+  const std::vector<UniformityCorrection::Gains> &profiles) {
+  uniformity_profiles_ = profiles;
+}
 
-      // OE of the previous row-data must be finished before strobe.
-      sOutputEnablePulser->WaitPulseFinished();
+void Framebuffer::Unpack() {
+  bitplane_buffer_ = AllocateBitplanes();
+  ExpandPacked(bitplane_buffer_);
+  delete [] packed_;
+  packed_ = NULL;
+  ResetStaging();
+}
 
-      // Setting address and strobing needs to happen in dark time.
-      row_setter_->SetRowAddress(io, d_row);
+void Framebuffer::DumpToMatrix(GPIO *io, int pwm_low_bit) {
+  if (packed_ != NULL) {
+    switch (PackedWordBytes()) {
+    case 1: DumpPackedToMatrix<uint8_t>(io, pwm_low_bit); break;
+    case 2: DumpPackedToMatrix<uint16_t>(io, pwm_low_bit); break;
+    case 4: DumpPackedToMatrix<uint32_t>(io, pwm_low_bit); break;
+    }
+    return;
+  }
+  (this->*dump_function_)(io, pwm_low_bit);
+}
 
-      io->SetBits(h.strobe);   // Strobe in the previously clocked in row.
-      io->ClearBits(h.strobe);
+inline int Framebuffer::PulsePlanes(int b, int end_plane, unsigned identical,
+                                    bool scaled, const int *timing_ns) {
+  PinPulser *const pulser = sOutputEnablePulser;
+  if (!(identical & (2u << b))) {
+    if (scaled) {
+      pulser->SendPulseNanos(timing_ns[b]);
+    } else {
+      pulser->SendPulse(b);
+    }
+    return b;
+  }
+  int nanos = timing_ns[b];
+  while (b + 1 < end_plane && (identical & (2u << b))) {
+    ++b;
+    nanos += timing_ns[b];
+  }
+  pulser->SendPulseNanos(nanos);
+  return b;
+}
 
-      // Now switch on for the sleep time necessary for that bit-plane.
-      sOutputEnablePulser->SendPulse(b);
+// Like DumpToMatrixImpl(), but color bits are unpacked on the fly.
+template <typename T>
+void Framebuffer::DumpPackedToMatrix(GPIO *io, int pwm_low_bit) {
+  const gpio_bits_t color_clk_mask = color_clk_mask_;
+  const gpio_bits_t clock = hardware_mapping_->clock;
+  const gpio_bits_t strobe = hardware_mapping_->strobe;
+  const int columns = columns_;
+  const int planes = bitplanes_;
+  const int chains = parallel_;
+  PinPulser *const pulser = sOutputEnablePulser;
+
+  const bool skip_empty = skip_empty_planes_ && !inverse_color_;
+  const OutputTiming &output_timing = TakeOutputTiming();
+  const bool scaled = output_timing.scaled;
+  const int *const timing_ns = scaled
+    ? output_timing.timing_ns : plane_timing_ns_;
+  const int start_bit = std::max(std::max(pwm_low_bit, planes - pwm_bits_),
+                                 output_timing.first_plane);
+
+  for (int pass = 0; pass < output_passes_; ++pass) {
+    const unsigned shown = pass_planes_[pass];
+    for (int row_loop = 0; row_loop < double_rows_; ++row_loop) {
+      const int d_row = row_order_[row_loop];
+      const unsigned occupied
+        = (skip_empty ? plane_occupancy_[d_row] : ~0u) & shown;
+      const unsigned identical = (merge_identical_planes_
+                                  && !planes_changed_[d_row])
+        ? identical_planes_[d_row] & shown : 0;
+      const T *row_data = (reinterpret_cast<const T*>(packed_)
+                           + d_row * (columns * planes)
+                           + start_bit * columns);
+
+      for (int b = start_bit; b < planes; ++b) {
+        if (!(occupied & (1u << b))) {
+          if (shown & (1u << b)) {
+            // Empty: nothing to clock in, but keep the timing.
+            pulser->WaitPulseFinished();
+            pulser->SendDarkPulseNanos(timing_ns[b]);
+          }
+          row_data += columns;
+          continue;
+        }
+
+        for (int col = 0; col < columns; ++col) {
+          io->WriteMaskedBits(UnpackWord(*row_data++, chains),
+                              color_clk_mask);
+          io->SetBits(clock);
+        }
+        io->ClearBits(color_clk_mask);
+
+        pulser->WaitPulseFinished();
+
+        row_setter_->SetRowAddress(io, d_row);
+
+        io->SetBits(strobe);
+        io->ClearBits(strobe);
+
+        const int last = PulsePlanes(b, planes, identical, scaled, timing_ns);
+        row_data += (last - b) * columns;
+        b = last;
+      }
+    }
+  }
+}
+
+template <class RowSetter>
+/* static */ Framebuffer::DumpFunction Framebuffer::GetDumpFunction(
+  int bitplanes) {
+  switch (bitplanes) {
+  case 1:  return &Framebuffer::DumpToMatrixImpl<1, RowSetter>;
+  case 2:  return &Framebuffer::DumpToMatrixImpl<2, RowSetter>;
+  case 3:  return &Framebuffer::DumpToMatrixImpl<3, RowSetter>;
+  case 4:  return &Framebuffer::DumpToMatrixImpl<4, RowSetter>;
+  case 5:  return &Framebuffer::DumpToMatrixImpl<5, RowSetter>;
+  case 6:  return &Framebuffer::DumpToMatrixImpl<6, RowSetter>;
+  case 7:  return &Framebuffer::DumpToMatrixImpl<7, RowSetter>;
+  case 8:  return &Framebuffer::DumpToMatrixImpl<8, RowSetter>;
+  case 9:  return &Framebuffer::DumpToMatrixImpl<9, RowSetter>;
+  case 10: return &Framebuffer::DumpToMatrixImpl<10, RowSetter>;
+  case 11: return &Framebuffer::DumpToMatrixImpl<11, RowSetter>;
+  case 12: return &Framebuffer::DumpToMatrixImpl<12, RowSetter>;
+  case 13: return &Framebuffer::DumpToMatrixImpl<13, RowSetter>;
+  case 14: return &Framebuffer::DumpToMatrixImpl<14, RowSetter>;
+  case 15: return &Framebuffer::DumpToMatrixImpl<15, RowSetter>;
+  case 16: return &Framebuffer::DumpToMatrixImpl<16, RowSetter>;
+  }
+  static_assert(kMaxBitPlanes == 16, "Add more DumpToMatrixImpl() cases");
+  assert(0);  // bitplanes out of range.
+  return NULL;
+}
+
+template <int kPlanes, class RowSetter>
+void Framebuffer::DumpToMatrixImpl(GPIO *io, int pwm_low_bit) {
+  // Keep everything we need in the loop in locals, so that the column loop
+  // is just the stores.
+  const gpio_bits_t color_clk_mask = color_clk_mask_;
+  const gpio_bits_t clock = hardware_mapping_->clock;
+  const gpio_bits_t strobe = hardware_mapping_->strobe;
+  const int columns = columns_;
+  RowSetter *const row_setter = static_cast<RowSetter*>(row_setter_);
+  PinPulser *const pulser = sOutputEnablePulser;
+
+  // With inverse colors, black is all bits set, so nothing is ever empty.
+  const bool skip_empty = skip_empty_planes_ && !inverse_color_;
+
+  // With brightness applied at output, pulses are scaled and the shortest
+  // ones possibly dropped.
+  const OutputTiming &output_timing = TakeOutputTiming();
+  const bool scaled = output_timing.scaled;
+  const int *const timing_ns = scaled
+    ? output_timing.timing_ns : plane_timing_ns_;
+
+  // Depending if we do dithering, we might not always show the lowest bits.
+  const int start_bit = std::max(std::max(pwm_low_bit, kPlanes - pwm_bits_),
+                                 output_timing.first_plane);
+
+  // Usually one pass; with split bits, the pieces of the most significant
+  // planes are spread over several.
+  for (int pass = 0; pass < output_passes_; ++pass) {
+    const unsigned shown = pass_planes_[pass];
+    for (int row_loop = 0; row_loop < double_rows_; ++row_loop) {
+      const int d_row = row_order_[row_loop];
+      const unsigned occupied
+        = (skip_empty ? plane_occupancy_[d_row] : ~0u) & shown;
+      // Drawing on the canvas while it is shown invalidates what we know.
+      // Only planes shown in this pass can be merged.
+      const unsigned identical = (merge_identical_planes_
+                                  && !planes_changed_[d_row])
+        ? identical_planes_[d_row] & shown : 0;
+      // The bitplanes of a double row follow each other.
+      const gpio_bits_t *row_data = (bitplane_buffer_
+                                     + d_row * (columns * kPlanes)
+                                     + start_bit * columns);
+
+      // Rows can't be switched very quickly without ghosting, so we do the
+      // full PWM of one row (in this pass) before switching rows.
+      for (int b = start_bit; b < kPlanes; ++b) {
+        // Nothing lit in this plane or not shown in this pass: no need to
+        // clock it in or switch it on. An empty plane still takes its time,
+        // so that the timing doesn't depend on the content.
+        if (!(occupied & (1u << b))) {
+          if (shown & (1u << b)) {
+            pulser->WaitPulseFinished();
+            pulser->SendDarkPulseNanos(timing_ns[b]);
+          }
+          row_data += columns;
+          continue;
+        }
+
+        // While the output enable is still on, we can already clock in the
+        // next data.
+        for (int col = 0; col < columns; ++col) {
+          io->WriteMaskedBits(*row_data++, color_clk_mask);  // col + reset clock
+          io->SetBits(clock);               // Rising edge: clock color in.
+        }
+        io->ClearBits(color_clk_mask);    // clock back to normal.
+
+        // OE of the previous row-data must be finished before strobe.
+        pulser->WaitPulseFinished();
+
+        // Setting address and strobing needs to happen in dark time.
+        row_setter->SetRowAddress(io, d_row);
+
+        io->SetBits(strobe);   // Strobe in the previously clocked in row.
+        io->ClearBits(strobe);
+
+        // Now switch on for the sleep time necessary for that bit-plane.
+        // The following bitplanes with the same content are shown in the
+        // same go.
+        const int last = PulsePlanes(b, kPlanes, identical, scaled,
+                                     timing_ns);
+        row_data += (last - b) * columns;
+        b = last;
+      }
     }
   }
 }
@@ -459,11 +459,19 @@ public:
   }
 
   virtual void SendPulse(int time_spec_number) {
+    SendPulseNanos(nano_specs_[time_spec_number]);
+  }
+
+  virtual void SendPulseNanos(int nanos) {
     io_->ClearBits(bits_);
-    Timers::sleep_nanos(nano_specs_[time_spec_number]);
+    Timers::sleep_nanos(nanos);
     io_->SetBits(bits_);
   }
 
+  virtual void SendDarkPulseNanos(int nanos) {
+    Timers::sleep_nanos(nanos);
+  }
+
 private:
   GPIO *const io_;
   const gpio_bits_t bits_;
@@ -662,7 +670,7 @@ public:
   }
 
   HardwarePinPulser(gpio_bits_t pins, const std::vector<int> &specs)
-    : triggered_(false) {
+    : base_nanos_(specs[0]), triggered_(false) {
     assert(CanHandle(pins));
     assert(s_CLK_registers && s_PWM_registers && s_Timer1Mhz);
 
@@ -708,48 +716,19 @@ public:
   }
 
   virtual void SendPulse(int c) {
-    if (pwm_range_[c] < 16) {
-      s_PWM_registers[PWM_RNG1] = pwm_range_[c];
-
-      *fifo_ = pwm_range_[c];
-    } else {
-      // Keep the actual range as short as possible, as we have to
-      // wait for one full period of these in the zero phase.
-      // The hardware can't deal with values < 2, so only do this when
-      // have enough of these.
-      s_PWM_registers[PWM_RNG1] = pwm_range_[c] / 8;
-
-      *fifo_ = pwm_range_[c] / 8;
-      *fifo_ = pwm_range_[c] / 8;
-      *fifo_ = pwm_range_[c] / 8;
-      *fifo_ = pwm_range_[c] / 8;
-      *fifo_ = pwm_range_[c] / 8;
-      *fifo_ = pwm_range_[c] / 8;
-      *fifo_ = pwm_range_[c] / 8;
-      *fifo_ = pwm_range_[c] / 8;
-    }
-
-    /*
-     * We need one value at the end to have it go back to
-     * default state (otherwise it just repeats the last
-     * value, so will be constantly 'on').
-     */
-    *fifo_ = 0;   // sentinel.
+    Pulse(pwm_range_[c], sleep_hints_us_[c]);
+  }
 
-    /*
-     * For some reason, we need a second empty sentinel in the
-     * fifo, otherwise our way to detect the end of the pulse,
-     * which relies on 'is the queue empty' does not work. It is
-     * not entirely clear why that is from the datasheet,
-     * but probably there is some buffering register in which data
-     * elements are kept after the fifo is emptied.
-     */
-    *fifo_ = 0;
+  virtual void SendPulseNanos(int nanos) {
+    // Arbitrary lengths, e.g. scaled for brightness: round to the closest
+    // number of PWM periods.
+    Pulse((2 * nanos + base_nanos_ / 2) / base_nanos_,
+          nanos / 1000 - JitterAllowanceMicroseconds());
+  }
 
-    sleep_hint_us_ = sleep_hints_us_[c];
-    start_time_ = *s_Timer1Mhz;
-    triggered_ = true;
-    s_PWM_registers[PWM_CTL] = PWM_CTL_USEF1 | PWM_CTL_PWEN1 | PWM_CTL_POLA1;
+  virtual void SendDarkPulseNanos(int nanos) {
+    Pulse((2 * nanos + base_nanos_ / 2) / base_nanos_,
+          nanos / 1000 - JitterAllowanceMicroseconds(), false);
   }
 
   virtual void WaitPulseFinished() {
@@ -791,6 +770,54 @@ public:
   }
 
 private:
+  // Pulse for "range" PWM periods; we can sleep "sleep_hint_us" of that.
+  // Not "lit", the output stays off for the same time.
+  void Pulse(uint32_t range, int sleep_hint_us, bool lit = true) {
+    if (range < 16) {
+      s_PWM_registers[PWM_RNG1] = range;
+
+      *fifo_ = lit ? range : 0;
+    } else {
+      // Keep the actual range as short as possible, as we have to
+      // wait for one full period of these in the zero phase.
+      // The hardware can't deal with values < 2, so only do this when
+      // have enough of these.
+      // Pulse lengths are not necessarily a multiple of 8 (merged planes,
+      // scaled brightness), so the last of at most 8 periods gets the rest.
+      const uint32_t period = (range + 7) / 8;
+      s_PWM_registers[PWM_RNG1] = period;
+
+      for (uint32_t i = 0; i < range / period; ++i) {
+        *fifo_ = lit ? period : 0;
+      }
+      if (range % period != 0) {
+        *fifo_ = lit ? range % period : 0;
+      }
+    }
+
+    /*
+     * We need one value at the end to have it go back to
+     * default state (otherwise it just repeats the last
+     * value, so will be constantly 'on').
+     */
+    *fifo_ = 0;   // sentinel.
+
+    /*
+     * For some reason, we need a second empty sentinel in the
+     * fifo, otherwise our way to detect the end of the pulse,
+     * which relies on 'is the queue empty' does not work. It is
+     * not entirely clear why that is from the datasheet,
+     * but probably there is some buffering register in which data
+     * elements are kept after the fifo is emptied.
+     */
+    *fifo_ = 0;
+
+    sleep_hint_us_ = sleep_hint_us;
+    start_time_ = *s_Timer1Mhz;
+    triggered_ = true;
+    s_PWM_registers[PWM_CTL] = PWM_CTL_USEF1 | PWM_CTL_PWEN1 | PWM_CTL_POLA1;
+  }
+
   void SetGPIOMode(volatile uint32_t *gpioReg, unsigned gpio, unsigned mode) {
     const int reg = gpio / 10;
     const int mode_pos = (gpio % 10) * 3;
@@ -818,6 +845,7 @@ private:
   }
 
 private:
+  const int base_nanos_;  // Shortest pulse; the PWM period is half of that.
   std::vector<uint32_t> pwm_range_;
   std::vector<int> sleep_hints_us_;
   volatile uint32_t *fifo_;
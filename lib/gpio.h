@@ -151,6 +151,14 @@ public:
   // Send a pulse with a given length (index into nano_wait_spec array).
   virtual void SendPulse(int time_spec_number) = 0;
 
+  // Send a pulse of arbitrary length. Should be a multiple of the shortest
+  // nano_wait_spec, otherwise it is rounded to the closest half of that.
+  virtual void SendPulseNanos(int nanos) = 0;
+
+  // Take as long as SendPulseNanos(), but without switching on; keeps the
+  // timing when there is nothing to show.
+  virtual void SendDarkPulseNanos(int nanos) = 0;
+
   // If SendPulse() is asynchronously implemented, wait for pulse to finish.
   virtual void WaitPulseFinished() {}
 };
@@ -14,11 +14,13 @@
 // along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
 
 #include "graphics.h"
+#include "led-matrix.h"
 #include "utf8-internal.h"
 
 #include <stdlib.h>
 #include <functional>
 #include <algorithm>
+#include <vector>
 
 namespace rgb_matrix {
 bool SetImage(Canvas *c, int canvas_offset_x, int canvas_offset_y,
@@ -57,6 +59,26 @@ bool SetImage(Canvas *c, int canvas_offset_x, int canvas_offset_y,
   const size_t next_row_skip = skip_start_row + skip_end_row;
   buffer += skip_start_row;
 
+  // A FrameCanvas can encode whole rows at once, which is a lot cheaper than
+  // going through SetPixel() for each pixel.
+  FrameCanvas *const frame_canvas = dynamic_cast<FrameCanvas*>(c);
+  if (frame_canvas != NULL) {
+    const int row_width = w - canvas_offset_x;
+    if (row_width <= 0) return true;
+    std::vector<Color> row(row_width);
+    for (int y = canvas_offset_y; y < h; ++y) {
+      for (int x = 0; x < row_width; ++x) {
+        row[x] = is_bgr
+          ? Color(buffer[2], buffer[1], buffer[0])
+          : Color(buffer[0], buffer[1], buffer[2]);
+        buffer += 3;
+      }
+      frame_canvas->SetPixels(canvas_offset_x, y, row_width, 1, row.data());
+      buffer += next_row_skip;
+    }
+    return true;
+  }
+
   if (is_bgr) {
     for (int y = canvas_offset_y; y < h; ++y) {
       for (int x = canvas_offset_x; x < w; ++x) {
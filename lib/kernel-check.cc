@@ -0,0 +1,164 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//
+// Check that the vectorized kernels give exactly the same result as the
+// portable scalar versions they replace: the bitplane encoders and the row
+// blends of the LayerCompositor. Runs every kernel this CPU supports on
+// random input and compares the output byte by byte.
+//
+//   make -C lib kernel-check && lib/kernel-check
+//
+// Exits with 0 if all kernels agree.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+
+#include "bitplane-encoder-internal.h"
+#include "framebuffer-internal.h"
+#include "layer-compositor-internal.h"
+
+using rgb_matrix::PremultipliedColor;
+using rgb_matrix::internal::BlendKernel;
+using rgb_matrix::internal::EncodeKernel;
+using rgb_matrix::internal::Framebuffer;
+using rgb_matrix::internal::GetAvailableBlendKernels;
+using rgb_matrix::internal::GetAvailableEncodeKernels;
+
+static const int kRounds = 20000;
+
+// Small and reproducible; rand() differs between C libraries.
+static uint32_t Random() {
+  static uint32_t state = 0x2545f491;
+  state ^= state << 13;
+  state ^= state >> 17;
+  state ^= state << 5;
+  return state;
+}
+
+static gpio_bits_t RandomWord() {
+  gpio_bits_t word = 0;
+  for (size_t i = 0; i < sizeof(word); i += 4) {
+    word = (word << 16 << 16) | Random();
+  }
+  return word;
+}
+
+// Encode random spans with the scalar kernel and "kernel"; returns the number
+// of spans that came out different.
+static int CheckEncodeKernel(const EncodeKernel &scalar,
+                             const EncodeKernel &kernel) {
+  const int kMaxCount = 100;
+  const int kPlanes = Framebuffer::kMaxBitPlanes;
+  uint16_t red[kMaxCount], green[kMaxCount], blue[kMaxCount];
+  std::vector<gpio_bits_t> expected, actual;
+  int failures = 0;
+  for (int round = 0; round < kRounds; ++round) {
+    const int count = Random() % (kMaxCount + 1);
+    const int plane_stride = count + Random() % 8;
+    const int first_plane = Random() % (kPlanes + 1);
+    const int end_plane = first_plane + Random() % (kPlanes - first_plane + 1);
+    for (int i = 0; i < count; ++i) {
+      red[i] = Random();
+      green[i] = Random();
+      blue[i] = Random();
+    }
+    // Three different bits; the other bits of each word must stay as they
+    // are, so start with random content.
+    const int bits = sizeof(gpio_bits_t) * 8;
+    const int r_pos = Random() % bits;
+    const int g_pos = (r_pos + 1 + Random() % (bits - 2)) % bits;
+    int b_pos = (g_pos + 1 + Random() % (bits - 2)) % bits;
+    if (b_pos == r_pos) b_pos = (b_pos + 1) % bits;
+    if (b_pos == g_pos) b_pos = (b_pos + 1) % bits;
+    expected.resize(plane_stride * kPlanes + 1);
+    for (size_t i = 0; i < expected.size(); ++i) expected[i] = RandomWord();
+    actual = expected;
+
+    scalar.encode_run(expected.data(), plane_stride, first_plane, end_plane,
+                      red, green, blue, count, (gpio_bits_t)1 << r_pos,
+                      (gpio_bits_t)1 << g_pos, (gpio_bits_t)1 << b_pos);
+    kernel.encode_run(actual.data(), plane_stride, first_plane, end_plane,
+                      red, green, blue, count, (gpio_bits_t)1 << r_pos,
+                      (gpio_bits_t)1 << g_pos, (gpio_bits_t)1 << b_pos);
+    if (memcmp(expected.data(), actual.data(),
+               expected.size() * sizeof(gpio_bits_t)) != 0) {
+      if (failures == 0) {
+        fprintf(stderr, "  %s: first difference with %d pixels, "
+                "planes %d..%d\n", kernel.name, count,
+                first_plane, end_plane);
+      }
+      ++failures;
+    }
+  }
+  return failures;
+}
+
+static PremultipliedColor RandomPremultiplied() {
+  // Mostly the extremes, which are where rounding goes wrong.
+  static const uint8_t kAlphas[] = { 0, 1, 127, 128, 254, 255 };
+  const uint32_t bits = Random();
+  PremultipliedColor c;
+  c.a = (bits & 1) ? kAlphas[(bits >> 1) % 6] : (bits >> 4);
+  c.r = (c.a == 0) ? 0 : Random() % (c.a + 1);
+  c.g = (c.a == 0) ? 0 : Random() % (c.a + 1);
+  c.b = (c.a == 0) ? 0 : Random() % (c.a + 1);
+  return c;
+}
+
+// Blend random rows with the scalar kernel and "kernel"; returns the number
+// of rows that came out different.
+static int CheckBlendKernel(const BlendKernel &scalar,
+                            const BlendKernel &kernel) {
+  const int kMaxCount = 100;
+  PremultipliedColor src[kMaxCount], expected[kMaxCount], actual[kMaxCount];
+  int failures = 0;
+  for (int round = 0; round < kRounds; ++round) {
+    const int count = Random() % (kMaxCount + 1);
+    const uint8_t opacity = (Random() & 1) ? 255 : Random();
+    for (int i = 0; i < count; ++i) {
+      src[i] = RandomPremultiplied();
+      expected[i] = actual[i] = RandomPremultiplied();
+    }
+    scalar.blend_row(expected, src, count, opacity);
+    kernel.blend_row(actual, src, count, opacity);
+    if (memcmp(expected, actual, count * sizeof(PremultipliedColor)) != 0) {
+      if (failures == 0) {
+        fprintf(stderr, "  %s: first difference with %d pixels, "
+                "opacity %d\n", kernel.name, count, opacity);
+      }
+      ++failures;
+    }
+  }
+  return failures;
+}
+
+int main(int argc, char *argv[]) {
+  int failures = 0;
+
+  const std::vector<EncodeKernel> &encoders = GetAvailableEncodeKernels();
+  for (size_t k = 1; k < encoders.size(); ++k) {
+    const int failed = CheckEncodeKernel(encoders[0], encoders[k]);
+    printf("encode %-8s %s (%d of %d spans differ)\n", encoders[k].name,
+           failed ? "FAIL" : "ok", failed, kRounds);
+    failures += failed;
+  }
+  if (encoders.size() == 1) {
+    printf("encode: only the scalar kernel on this CPU\n");
+  }
+
+  const std::vector<BlendKernel> &blenders = GetAvailableBlendKernels();
+  for (size_t k = 1; k < blenders.size(); ++k) {
+    const int failed = CheckBlendKernel(blenders[0], blenders[k]);
+    printf("blend  %-8s %s (%d of %d rows differ)\n", blenders[k].name,
+           failed ? "FAIL" : "ok", failed, kRounds);
+    failures += failed;
+  }
+  if (blenders.size() == 1) {
+    printf("blend: only the scalar kernel on this CPU\n");
+  }
+
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,37 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//
+// Row blend implementations of the LayerCompositor.
+#ifndef RPI_RGBMATRIX_LAYER_COMPOSITOR_INTERNAL_H
+#define RPI_RGBMATRIX_LAYER_COMPOSITOR_INTERNAL_H
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "layer-compositor.h"
+
+namespace rgb_matrix {
+namespace internal {
+
+// Blend "count" premultiplied "src" pixels, scaled by "opacity", over "dst":
+// dst = src + dst * (1 - src.alpha). All implementations round the same way
+// so they give exactly the same result.
+typedef void (*BlendRowFunction)(PremultipliedColor *dst,
+                                 const PremultipliedColor *src, int count,
+                                 uint8_t opacity);
+
+struct BlendKernel {
+  const char *name;
+  BlendRowFunction blend_row;
+};
+
+// Kernel that is the fastest on this CPU. Chosen once at first call.
+const BlendKernel &GetBlendKernel();
+
+// All kernels that can run on this CPU, the portable "scalar" kernel first.
+// Like the encode kernels, mostly useful to compare them against each other.
+const std::vector<BlendKernel> &GetAvailableBlendKernels();
+
+}  // namespace internal
+}  // namespace rgb_matrix
+#endif  // RPI_RGBMATRIX_LAYER_COMPOSITOR_INTERNAL_H
@@ -0,0 +1,437 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//
+// Blending of the layers; the row blend is vectorized where the CPU supports
+// it, chosen at runtime like the bitplane encoder kernels.
+
+#include "layer-compositor.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#include "layer-compositor-internal.h"
+#include "led-matrix.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#  define LAYER_BLEND_X86 1
+#  include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__aarch64__)
+#  define LAYER_BLEND_NEON 1
+#  include <arm_neon.h>
+#endif
+
+namespace rgb_matrix {
+namespace internal {
+namespace {
+// x / 255, correctly rounded for x in 0..255*255.
+inline uint8_t Div255(uint32_t x) {
+  x += 128;
+  return (x + (x >> 8)) >> 8;
+}
+
+inline uint8_t AddSaturated(uint8_t a, uint8_t b) {
+  const int sum = a + b;
+  return sum > 255 ? 255 : sum;
+}
+
+void BlendRowScalar(PremultipliedColor *dst, const PremultipliedColor *src,
+                    int count, uint8_t opacity) {
+  for (int i = 0; i < count; ++i) {
+    PremultipliedColor s = src[i];
+    if (opacity != 255) {
+      s.r = Div255(s.r * opacity);
+      s.g = Div255(s.g * opacity);
+      s.b = Div255(s.b * opacity);
+      s.a = Div255(s.a * opacity);
+    }
+    PremultipliedColor &d = dst[i];
+    const int inverse_alpha = 255 - s.a;
+    d.r = AddSaturated(s.r, Div255(d.r * inverse_alpha));
+    d.g = AddSaturated(s.g, Div255(d.g * inverse_alpha));
+    d.b = AddSaturated(s.b, Div255(d.b * inverse_alpha));
+    d.a = AddSaturated(s.a, Div255(d.a * inverse_alpha));
+  }
+}
+
+#if LAYER_BLEND_X86
+// Four pixels at a time, the channels widened to 16 bit lanes. The alpha of
+// each pixel is spread to the lanes of its channels with shuffles.
+__attribute__((target("sse2")))
+inline __m128i Div255SSE2(__m128i x) {
+  x = _mm_add_epi16(x, _mm_set1_epi16(128));
+  return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+}
+
+__attribute__((target("sse2")))
+inline __m128i SpreadAlphaSSE2(__m128i x) {
+  return _mm_shufflehi_epi16(_mm_shufflelo_epi16(x, _MM_SHUFFLE(3, 3, 3, 3)),
+                             _MM_SHUFFLE(3, 3, 3, 3));
+}
+
+__attribute__((target("sse2")))
+void BlendRowSSE2(PremultipliedColor *dst, const PremultipliedColor *src,
+                  int count, uint8_t opacity) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i all = _mm_set1_epi16(255);
+  const __m128i scale = _mm_set1_epi16(opacity);
+  int i = 0;
+  for (/**/; i + 4 <= count; i += 4) {
+    const __m128i s = _mm_loadu_si128((const __m128i*)(src + i));
+    __m128i s_lo = _mm_unpacklo_epi8(s, zero);
+    __m128i s_hi = _mm_unpackhi_epi8(s, zero);
+    if (opacity != 255) {
+      s_lo = Div255SSE2(_mm_mullo_epi16(s_lo, scale));
+      s_hi = Div255SSE2(_mm_mullo_epi16(s_hi, scale));
+    }
+    __m128i *const out = (__m128i*)(dst + i);
+    const __m128i d = _mm_loadu_si128(out);
+    const __m128i d_lo = Div255SSE2(
+      _mm_mullo_epi16(_mm_unpacklo_epi8(d, zero),
+                      _mm_sub_epi16(all, SpreadAlphaSSE2(s_lo))));
+    const __m128i d_hi = Div255SSE2(
+      _mm_mullo_epi16(_mm_unpackhi_epi8(d, zero),
+                      _mm_sub_epi16(all, SpreadAlphaSSE2(s_hi))));
+    _mm_storeu_si128(out, _mm_adds_epu8(_mm_packus_epi16(s_lo, s_hi),
+                                        _mm_packus_epi16(d_lo, d_hi)));
+  }
+  BlendRowScalar(dst + i, src + i, count - i, opacity);
+}
+
+// Same as the SSE2 version, but eight pixels at a time.
+__attribute__((target("avx2")))
+inline __m256i Div255AVX2(__m256i x) {
+  x = _mm256_add_epi16(x, _mm256_set1_epi16(128));
+  return _mm256_srli_epi16(_mm256_add_epi16(x, _mm256_srli_epi16(x, 8)), 8);
+}
+
+__attribute__((target("avx2")))
+inline __m256i SpreadAlphaAVX2(__m256i x) {
+  return _mm256_shufflehi_epi16(
+    _mm256_shufflelo_epi16(x, _MM_SHUFFLE(3, 3, 3, 3)),
+    _MM_SHUFFLE(3, 3, 3, 3));
+}
+
+__attribute__((target("avx2")))
+void BlendRowAVX2(PremultipliedColor *dst, const PremultipliedColor *src,
+                  int count, uint8_t opacity) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i all = _mm256_set1_epi16(255);
+  const __m256i scale = _mm256_set1_epi16(opacity);
+  int i = 0;
+  for (/**/; i + 8 <= count; i += 8) {
+    const __m256i s = _mm256_loadu_si256((const __m256i*)(src + i));
+    __m256i s_lo = _mm256_unpacklo_epi8(s, zero);
+    __m256i s_hi = _mm256_unpackhi_epi8(s, zero);
+    if (opacity != 255) {
+      s_lo = Div255AVX2(_mm256_mullo_epi16(s_lo, scale));
+      s_hi = Div255AVX2(_mm256_mullo_epi16(s_hi, scale));
+    }
+    __m256i *const out = (__m256i*)(dst + i);
+    const __m256i d = _mm256_loadu_si256(out);
+    const __m256i d_lo = Div255AVX2(
+      _mm256_mullo_epi16(_mm256_unpacklo_epi8(d, zero),
+                         _mm256_sub_epi16(all, SpreadAlphaAVX2(s_lo))));
+    const __m256i d_hi = Div255AVX2(
+      _mm256_mullo_epi16(_mm256_unpackhi_epi8(d, zero),
+                         _mm256_sub_epi16(all, SpreadAlphaAVX2(s_hi))));
+    // Unpacking and packing both work within 128 bit halves, so the pixels
+    // come out in the order they went in.
+    _mm256_storeu_si256(out, _mm256_adds_epu8(_mm256_packus_epi16(s_lo, s_hi),
+                                              _mm256_packus_epi16(d_lo, d_hi)));
+  }
+  BlendRowSSE2(dst + i, src + i, count - i, opacity);
+}
+#endif  // LAYER_BLEND_X86
+
+#if LAYER_BLEND_NEON
+// Sixteen pixels at a time; vld4 conveniently splits them into channels.
+inline uint8x8_t Div255NEON(uint16x8_t x) {
+  x = vaddq_u16(x, vdupq_n_u16(128));
+  return vmovn_u16(vshrq_n_u16(vaddq_u16(x, vshrq_n_u16(x, 8)), 8));
+}
+
+inline uint8x16_t MultiplyNEON(uint8x16_t a, uint8x16_t b) {
+  return vcombine_u8(Div255NEON(vmull_u8(vget_low_u8(a), vget_low_u8(b))),
+                     Div255NEON(vmull_u8(vget_high_u8(a), vget_high_u8(b))));
+}
+
+void BlendRowNEON(PremultipliedColor *dst, const PremultipliedColor *src,
+                  int count, uint8_t opacity) {
+  const uint8x16_t scale = vdupq_n_u8(opacity);
+  int i = 0;
+  for (/**/; i + 16 <= count; i += 16) {
+    uint8x16x4_t s = vld4q_u8((const uint8_t*)(src + i));
+    if (opacity != 255) {
+      for (int c = 0; c < 4; ++c) s.val[c] = MultiplyNEON(s.val[c], scale);
+    }
+    const uint8x16_t inverse_alpha = vmvnq_u8(s.val[3]);
+    uint8x16x4_t d = vld4q_u8((const uint8_t*)(dst + i));
+    for (int c = 0; c < 4; ++c) {
+      d.val[c] = vqaddq_u8(s.val[c], MultiplyNEON(d.val[c], inverse_alpha));
+    }
+    vst4q_u8((uint8_t*)(dst + i), d);
+  }
+  BlendRowScalar(dst + i, src + i, count - i, opacity);
+}
+#endif  // LAYER_BLEND_NEON
+
+std::vector<BlendKernel> CreateAvailableBlendKernels() {
+  std::vector<BlendKernel> result;
+  result.push_back({ "scalar", &BlendRowScalar });
+#if LAYER_BLEND_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse2")) {
+    result.push_back({ "sse2", &BlendRowSSE2 });
+  }
+  if (__builtin_cpu_supports("sse2") && __builtin_cpu_supports("avx2")) {
+    result.push_back({ "avx2", &BlendRowAVX2 });
+  }
+#endif
+#if LAYER_BLEND_NEON
+  result.push_back({ "neon", &BlendRowNEON });
+#endif
+  return result;
+}
+}  // anonymous namespace
+
+const std::vector<BlendKernel> &GetAvailableBlendKernels() {
+  static const std::vector<BlendKernel> kernels
+    = CreateAvailableBlendKernels();
+  return kernels;
+}
+
+const BlendKernel &GetBlendKernel() {
+  // Kernels are sorted from slowest to fastest.
+  static const BlendKernel &best = GetAvailableBlendKernels().back();
+  return best;
+}
+}  // namespace internal
+
+namespace {
+const PremultipliedColor kTransparent = { 0, 0, 0, 0 };
+}  // anonymous namespace
+
+Layer::Layer(LayerCompositor *compositor, int width, int height)
+  : compositor_(compositor), width_(width), height_(height),
+    pixels_(width * height, kTransparent),
+    x_(0), y_(0), opacity_(255), visible_(true),
+    dirty_x0_(width), dirty_y0_(height), dirty_x1_(0), dirty_y1_(0) {
+}
+
+void Layer::SetPixelRGBA(int x, int y, uint8_t red, uint8_t green,
+                         uint8_t blue, uint8_t alpha) {
+  if (x < 0 || x >= width_ || y < 0 || y >= height_) return;
+  PremultipliedColor &p = pixels_[y * width_ + x];
+  p.r = internal::Div255(red * alpha);
+  p.g = internal::Div255(green * alpha);
+  p.b = internal::Div255(blue * alpha);
+  p.a = alpha;
+  MarkDirty(x, y, 1, 1);
+}
+
+void Layer::SetPixel(int x, int y, uint8_t red, uint8_t green, uint8_t blue) {
+  if (x < 0 || x >= width_ || y < 0 || y >= height_) return;
+  const PremultipliedColor p = { red, green, blue, 255 };
+  pixels_[y * width_ + x] = p;
+  MarkDirty(x, y, 1, 1);
+}
+
+void Layer::SetPixels(int x, int y, int width, int height,
+                      const Color *colors) {
+  const int x_start = std::max(x, 0);
+  const int x_end = std::min(x + width, width_);
+  const int y_start = std::max(y, 0);
+  const int y_end = std::min(y + height, height_);
+  if (x_start >= x_end || y_start >= y_end) return;
+  for (int row = y_start; row < y_end; ++row) {
+    const Color *from = colors + (row - y) * width + (x_start - x);
+    PremultipliedColor *to = &pixels_[row * width_ + x_start];
+    for (int i = x_end - x_start; i > 0; --i, ++from, ++to) {
+      to->r = from->r;
+      to->g = from->g;
+      to->b = from->b;
+      to->a = 255;
+    }
+  }
+  MarkDirty(x_start, y_start, x_end - x_start, y_end - y_start);
+}
+
+void Layer::SetPixels(int x, int y, int width, int height,
+                      const PremultipliedColor *colors) {
+  const int x_start = std::max(x, 0);
+  const int x_end = std::min(x + width, width_);
+  const int y_start = std::max(y, 0);
+  const int y_end = std::min(y + height, height_);
+  if (x_start >= x_end || y_start >= y_end) return;
+  for (int row = y_start; row < y_end; ++row) {
+    memcpy(&pixels_[row * width_ + x_start],
+           colors + (row - y) * width + (x_start - x),
+           (x_end - x_start) * sizeof(PremultipliedColor));
+  }
+  MarkDirty(x_start, y_start, x_end - x_start, y_end - y_start);
+}
+
+void Layer::Clear() {
+  std::fill(pixels_.begin(), pixels_.end(), kTransparent);
+  MarkDirty(0, 0, width_, height_);
+}
+
+void Layer::Fill(uint8_t red, uint8_t green, uint8_t blue) {
+  const PremultipliedColor p = { red, green, blue, 255 };
+  std::fill(pixels_.begin(), pixels_.end(), p);
+  MarkDirty(0, 0, width_, height_);
+}
+
+void Layer::SetPosition(int x, int y) {
+  if (x == x_ && y == y_) return;
+  compositor_->MarkLayerArea(this);
+  x_ = x;
+  y_ = y;
+  compositor_->MarkLayerArea(this);
+}
+
+void Layer::SetOpacity(uint8_t opacity) {
+  if (opacity == opacity_) return;
+  opacity_ = opacity;
+  compositor_->MarkLayerArea(this);
+}
+
+void Layer::SetVisible(bool visible) {
+  if (visible == visible_) return;
+  visible_ = true;   // So that the area is marked either way.
+  compositor_->MarkLayerArea(this);
+  visible_ = visible;
+}
+
+LayerCompositor::LayerCompositor(int width, int height)
+  : width_(width), height_(height), composited_(width * height),
+    row_(width) {
+  const Span empty = { width, 0 };
+  dirty_.resize(height, empty);
+}
+
+LayerCompositor::~LayerCompositor() {
+  for (size_t i = 0; i < layers_.size(); ++i) {
+    delete layers_[i];
+  }
+}
+
+Layer *LayerCompositor::AddLayer(int width, int height) {
+  if (width <= 0 || height <= 0) return NULL;
+  Layer *layer = new Layer(this, width, height);
+  layers_.push_back(layer);
+  return layer;   // Transparent, so nothing changes on the canvas yet.
+}
+
+void LayerCompositor::RemoveLayer(Layer *layer) {
+  std::vector<Layer*>::iterator found
+    = std::find(layers_.begin(), layers_.end(), layer);
+  if (found == layers_.end()) return;
+  MarkLayerArea(layer);
+  layers_.erase(found);
+  delete layer;
+}
+
+void LayerCompositor::ForgetCanvas(FrameCanvas *canvas) {
+  pending_.erase(canvas);
+}
+
+void LayerCompositor::MarkDirty(int x, int y, int width, int height) {
+  const int x_start = std::max(x, 0);
+  const int x_end = std::min(x + width, width_);
+  const int y_start = std::max(y, 0);
+  const int y_end = std::min(y + height, height_);
+  if (x_start >= x_end) return;
+  for (int row = y_start; row < y_end; ++row) {
+    Span &span = dirty_[row];
+    span.x0 = std::min(span.x0, x_start);
+    span.x1 = std::max(span.x1, x_end);
+  }
+}
+
+void LayerCompositor::MarkLayerArea(const Layer *layer) {
+  if (!layer->visible_) return;
+  MarkDirty(layer->x_, layer->y_, layer->width_, layer->height_);
+}
+
+void LayerCompositor::CompositeRow(int y, int x0, int x1) {
+  static const internal::BlendRowFunction blend_row
+    = internal::GetBlendKernel().blend_row;
+  const PremultipliedColor black = { 0, 0, 0, 255 };
+  std::fill(row_.begin(), row_.begin() + (x1 - x0), black);
+  for (size_t i = 0; i < layers_.size(); ++i) {
+    const Layer *layer = layers_[i];
+    if (!layer->visible_ || layer->opacity_ == 0) continue;
+    const int layer_y = y - layer->y_;
+    if (layer_y < 0 || layer_y >= layer->height_) continue;
+    const int start = std::max(x0, layer->x_);
+    const int end = std::min(x1, layer->x_ + layer->width_);
+    if (start >= end) continue;
+    blend_row(&row_[start - x0],
+              &layer->pixels_[layer_y * layer->width_ + start - layer->x_],
+              end - start, layer->opacity_);
+  }
+  Color *out = &composited_[y * width_ + x0];
+  for (int x = x0; x < x1; ++x, ++out) {
+    const PremultipliedColor &p = row_[x - x0];
+    out->r = p.r;
+    out->g = p.g;
+    out->b = p.b;
+  }
+}
+
+void LayerCompositor::Render(FrameCanvas *canvas) {
+  // Collect what changed in the layers since last time.
+  for (size_t i = 0; i < layers_.size(); ++i) {
+    Layer *layer = layers_[i];
+    if (!layer->dirty()) continue;
+    if (layer->visible_) {
+      MarkDirty(layer->x_ + layer->dirty_x0_, layer->y_ + layer->dirty_y0_,
+                layer->dirty_x1_ - layer->dirty_x0_,
+                layer->dirty_y1_ - layer->dirty_y0_);
+    }
+    layer->dirty_x0_ = layer->width_;
+    layer->dirty_y0_ = layer->height_;
+    layer->dirty_x1_ = layer->dirty_y1_ = 0;
+  }
+
+  // A canvas seen for the first time, or released and created again since,
+  // needs everything.
+  std::map<FrameCanvas*, Pending>::iterator target = pending_.find(canvas);
+  if (target == pending_.end()) {
+    target = pending_.insert(std::make_pair(canvas, Pending())).first;
+  }
+  Pending &target_pending = target->second;
+  if (target_pending.rows.empty()
+      || target_pending.generation != canvas->generation()) {
+    const Span all = { 0, width_ };
+    target_pending.generation = canvas->generation();
+    target_pending.rows.assign(height_, all);
+  }
+
+  for (int y = 0; y < height_; ++y) {
+    Span &dirty = dirty_[y];
+    if (dirty.x0 >= dirty.x1) continue;
+    CompositeRow(y, dirty.x0, dirty.x1);
+    for (std::map<FrameCanvas*, Pending>::iterator it = pending_.begin();
+         it != pending_.end(); ++it) {
+      Span &pending = it->second.rows[y];
+      pending.x0 = std::min(pending.x0, dirty.x0);
+      pending.x1 = std::max(pending.x1, dirty.x1);
+    }
+    dirty.x0 = width_;
+    dirty.x1 = 0;
+  }
+
+  std::vector<Span> &spans = target_pending.rows;
+  for (int y = 0; y < height_; ++y) {
+    Span &span = spans[y];
+    if (span.x0 >= span.x1) continue;
+    canvas->SetPixels(span.x0, y, span.x1 - span.x0, 1,
+                      &composited_[y * width_ + span.x0]);
+    span.x0 = width_;
+    span.x1 = 0;
+  }
+}
+
+}  // namespace rgb_matrix
@@ -89,6 +89,17 @@ static struct RGBLedMatrix *led_matrix_create_from_options_optional_edit(
     OPT_COPY_IF_SET(panel_type);
     OPT_COPY_IF_SET(limit_refresh_rate_hz);
     OPT_COPY_IF_SET(disable_busy_waiting);
+    OPT_COPY_IF_SET(encode_threads);
+    OPT_COPY_IF_SET(max_pwm_bits);
+    OPT_COPY_IF_SET(skip_empty_planes);
+    OPT_COPY_IF_SET(merge_identical_planes);
+    OPT_COPY_IF_SET(brightness_at_output);
+    OPT_COPY_IF_SET(huge_pages);
+    OPT_COPY_IF_SET(spatial_dither);
+    OPT_COPY_IF_SET(pwm_dither_sequence);
+    OPT_COPY_IF_SET(pwm_split_bits);
+    OPT_COPY_IF_SET(scan_order);
+    OPT_COPY_IF_SET(uniformity_file);
 #undef OPT_COPY_IF_SET
   }
 
@@ -136,6 +147,17 @@ static struct RGBLedMatrix *led_matrix_create_from_options_optional_edit(
     ACTUAL_VALUE_BACK_TO_OPT(panel_type);
     ACTUAL_VALUE_BACK_TO_OPT(limit_refresh_rate_hz);
     ACTUAL_VALUE_BACK_TO_OPT(disable_busy_waiting);
+    ACTUAL_VALUE_BACK_TO_OPT(encode_threads);
+    ACTUAL_VALUE_BACK_TO_OPT(max_pwm_bits);
+    ACTUAL_VALUE_BACK_TO_OPT(skip_empty_planes);
+    ACTUAL_VALUE_BACK_TO_OPT(merge_identical_planes);
+    ACTUAL_VALUE_BACK_TO_OPT(brightness_at_output);
+    ACTUAL_VALUE_BACK_TO_OPT(huge_pages);
+    ACTUAL_VALUE_BACK_TO_OPT(spatial_dither);
+    ACTUAL_VALUE_BACK_TO_OPT(pwm_dither_sequence);
+    ACTUAL_VALUE_BACK_TO_OPT(pwm_split_bits);
+    ACTUAL_VALUE_BACK_TO_OPT(scan_order);
+    ACTUAL_VALUE_BACK_TO_OPT(uniformity_file);
 #undef ACTUAL_VALUE_BACK_TO_OPT
   }
 
@@ -202,11 +224,56 @@ struct LedCanvas *led_matrix_create_offscreen_canvas(struct RGBLedMatrix *m) {
   return from_canvas(to_matrix(m)->CreateFrameCanvas());
 }
 
+bool led_matrix_release_offscreen_canvas(struct RGBLedMatrix *matrix,
+                                         struct LedCanvas *canvas) {
+  return to_matrix(matrix)->ReleaseFrameCanvas(to_canvas(canvas));
+}
+
 struct LedCanvas *led_matrix_swap_on_vsync(struct RGBLedMatrix *matrix,
                                            struct LedCanvas *canvas) {
   return from_canvas(to_matrix(matrix)->SwapOnVSync(to_canvas(canvas)));
 }
 
+struct LedCanvas *led_matrix_swap_on_vsync_incremental(
+  struct RGBLedMatrix *matrix, struct LedCanvas *canvas) {
+  return from_canvas(
+    to_matrix(matrix)->SwapOnVSyncIncremental(to_canvas(canvas)));
+}
+
+struct LedCanvas *led_matrix_crossfade_on_vsync(struct RGBLedMatrix *matrix,
+                                                struct LedCanvas *canvas,
+                                                int duration_ms) {
+  return from_canvas(
+    to_matrix(matrix)->CrossfadeOnVSync(to_canvas(canvas), duration_ms));
+}
+
+bool led_canvas_pack(struct LedCanvas *canvas) {
+  return to_canvas(canvas)->Pack();
+}
+
+void led_canvas_scroll(struct LedCanvas *canvas, int dx, int dy,
+                       int x, int y, int width, int height) {
+  to_canvas(canvas)->Scroll(dx, dy, x, y, width, height);
+}
+
+void led_canvas_set_spatial_dither(struct LedCanvas *canvas, bool on) {
+  to_canvas(canvas)->set_spatial_dither(on);
+}
+
+void led_canvas_set_rgb_shadow(struct LedCanvas *canvas, bool on) {
+  to_canvas(canvas)->set_rgb_shadow(on);
+}
+
+void led_canvas_get_pixel(struct LedCanvas *canvas, int x, int y,
+                          uint8_t *red, uint8_t *green, uint8_t *blue) {
+  to_canvas(canvas)->GetPixel(x, y, red, green, blue);
+}
+
+void led_canvas_get_pixels(struct LedCanvas *canvas, int x, int y,
+                           int width, int height, struct Color *colors) {
+  to_canvas(canvas)->GetPixels(x, y, width, height, to_color(colors));
+}
+
 void led_matrix_set_brightness(struct RGBLedMatrix *matrix,
                                uint8_t brightness) {
   to_matrix(matrix)->SetBrightness(brightness);
@@ -29,6 +29,9 @@
 #include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
+
+#include "bitplane-encoder-internal.h"
 #include "gpio.h"
 #include "thread.h"
 #include "framebuffer-internal.h"
@@ -73,7 +76,11 @@ public:
   bool StartRefresh();
 
   FrameCanvas *CreateFrameCanvas();
+  bool ReleaseFrameCanvas(FrameCanvas *canvas);
   FrameCanvas *SwapOnVSync(FrameCanvas *other, unsigned framerate_fraction);
+  FrameCanvas *SwapOnVSyncIncremental(FrameCanvas *other,
+                                      unsigned framerate_fraction);
+  FrameCanvas *CrossfadeOnVSync(FrameCanvas *other, int duration_ms);
   bool ApplyPixelMapper(const PixelMapper *mapper);
 
   bool SetPWMBits(uint8_t value);
@@ -96,6 +103,10 @@ public:
 private:
   friend class RGBMatrix;
 
+  // SwapOnVSync(), crossfading over "fade_usec" if not 0.
+  FrameCanvas *SwapOrCrossfade(FrameCanvas *other, unsigned frame_fraction,
+                               uint32_t fade_usec);
+
   // Apply pixel mappers that have been passed down via a configuration
   // string.
   void ApplyNamedPixelMappers(const char *pixel_mapper_config,
@@ -109,9 +120,13 @@ private:
   GPIO *io_;
   Mutex active_frame_sync_;
   UpdateThread *updater_;
+  internal::EncodeWorkerPool *encode_pool_;  // Only with deferred encoding.
   std::vector<FrameCanvas*> created_frames_;
+  std::vector<FrameCanvas*> released_frames_;  // To be re-used.
+  internal::BufferArena *frame_arena_;  // Bitplane memory of all canvases.
   internal::PixelDesignatorMap *shared_pixel_mapper_;
   uint64_t user_output_bits_;
+  std::vector<uint8_t> dither_sequence_;  // Lowest bitplane per refresh.
 };
 
 using namespace internal;
@@ -119,31 +134,21 @@ using namespace internal;
 // Pump pixels to screen. Needs to be high priority real-time because jitter
 class RGBMatrix::Impl::UpdateThread : public Thread {
 public:
+  // "dither_sequence" is the lowest bitplane to show in each refresh,
+  // repeated.
   UpdateThread(GPIO *io, FrameCanvas *initial_frame,
-               int pwm_dither_bits, bool show_refresh,
+               const std::vector<uint8_t> &dither_sequence, bool show_refresh,
                int limit_refresh_hz, bool allow_busy_waiting)
     : io_(io), show_refresh_(show_refresh),
       target_frame_usec_(limit_refresh_hz < 1 ? 0 : 1e6/limit_refresh_hz),
       allow_busy_waiting_(allow_busy_waiting),
+      start_bit_(dither_sequence),
       running_(true),
       current_frame_(initial_frame), next_frame_(NULL),
-      requested_frame_multiple_(1) {
+      requested_frame_multiple_(1), next_fade_usec_(0),
+      fade_to_(NULL), fade_start_us_(0), fade_usec_(0), fade_mix_(0) {
     pthread_cond_init(&frame_done_, NULL);
     pthread_cond_init(&input_change_, NULL);
-    switch (pwm_dither_bits) {
-    case 0:
-      start_bit_[0] = 0; start_bit_[1] = 0;
-      start_bit_[2] = 0; start_bit_[3] = 0;
-      break;
-    case 1:
-      start_bit_[0] = 0; start_bit_[1] = 1;
-      start_bit_[2] = 0; start_bit_[3] = 1;
-      break;
-    case 2:
-      start_bit_[0] = 0; start_bit_[1] = 1;
-      start_bit_[2] = 2; start_bit_[3] = 2;
-      break;
-    }
   }
 
   void Stop() {
@@ -153,7 +158,7 @@ public:
 
   virtual void Run() {
     unsigned frame_count = 0;
-    unsigned low_bit_sequence = 0;
+    size_t low_bit_sequence = 0;
     uint32_t largest_time = 0;
     gpio_bits_t last_gpio_bits = 0;
 
@@ -166,23 +171,47 @@ public:
     while (running()) {
       const uint32_t start_time_us = GetMicrosecondCounter();
 
-      current_frame_->framebuffer()
-        ->DumpToMatrix(io_, start_bit_[low_bit_sequence % 4]);
+      // While crossfading, the new frame is shown in a share of the
+      // refreshes that grows with the time since the fade started; the
+      // old one in the others.
+      FrameCanvas *shown = current_frame_;
+      if (fade_to_ != NULL) {
+        fade_mix_ += start_time_us - fade_start_us_;
+        if (fade_mix_ >= fade_usec_) {
+          fade_mix_ -= fade_usec_;
+          shown = fade_to_;
+        }
+      }
+
+      shown->framebuffer()->DumpToMatrix(io_, start_bit_[low_bit_sequence]);
 
       // SwapOnVSync() exchange.
       {
         MutexLock l(&frame_sync_);
+        if (fade_to_ != NULL
+            && GetMicrosecondCounter() - fade_start_us_ >= fade_usec_) {
+          current_frame_ = fade_to_;
+          fade_to_ = NULL;
+        }
         // Do fast equality test first (likely due to frame_count reset).
         if (frame_count == requested_frame_multiple_
             || frame_count % requested_frame_multiple_ == 0) {
           // We reset to avoid frame hick-up every couple of weeks
           // run-time iff requested_frame_multiple_ is not a factor of 2^32.
           frame_count = 0;
-          if (next_frame_ != NULL) {
-            current_frame_ = next_frame_;
+          // A new frame has to wait until a crossfade is done.
+          if (next_frame_ != NULL && fade_to_ == NULL) {
+            if (next_fade_usec_ > 0) {
+              fade_to_ = next_frame_;
+              fade_start_us_ = GetMicrosecondCounter();
+              fade_usec_ = next_fade_usec_;
+              fade_mix_ = 0;
+            } else {
+              current_frame_ = next_frame_;
+            }
             next_frame_ = NULL;
           }
-          pthread_cond_signal(&frame_done_);
+          if (fade_to_ == NULL) pthread_cond_signal(&frame_done_);
         }
       }
 
@@ -196,7 +225,7 @@ public:
       }
 
       ++frame_count;
-      ++low_bit_sequence;
+      if (++low_bit_sequence == start_bit_.size()) low_bit_sequence = 0;
 
       if (target_frame_usec_) {
         if (allow_busy_waiting_) {
@@ -226,10 +255,14 @@ public:
     }
   }
 
-  FrameCanvas *SwapOnVSync(FrameCanvas *other, unsigned frame_fraction) {
+  // With "fade_usec" > 0, "other" is crossfaded in over that time; returns
+  // once the fade is done.
+  FrameCanvas *SwapOnVSync(FrameCanvas *other, unsigned frame_fraction,
+                           uint32_t fade_usec = 0) {
     MutexLock l(&frame_sync_);
     FrameCanvas *previous = current_frame_;
     next_frame_ = other;
+    next_fade_usec_ = fade_usec;
     requested_frame_multiple_ = frame_fraction;
     frame_sync_.WaitOn(&frame_done_);
     return previous;
@@ -251,7 +284,7 @@ private:
   const bool show_refresh_;
   const uint32_t target_frame_usec_;
   const bool allow_busy_waiting_;
-  uint32_t start_bit_[4];
+  const std::vector<uint8_t> start_bit_;
 
   Mutex running_mutex_;
   bool running_;
@@ -265,6 +298,13 @@ private:
   FrameCanvas *current_frame_;
   FrameCanvas *next_frame_;
   unsigned requested_frame_multiple_;
+  uint32_t next_fade_usec_;     // Crossfade time for next_frame_.
+
+  // Crossfade from current_frame_ to fade_to_, if not NULL.
+  FrameCanvas *fade_to_;
+  uint32_t fade_start_us_;
+  uint32_t fade_usec_;
+  uint64_t fade_mix_;           // Time accumulated to show fade_to_.
 };
 
 // Some defaults. See options-initialize.cc for the command line parsing.
@@ -325,10 +365,17 @@ RGBMatrix::Options::Options() :
   limit_refresh_rate_hz(0),
 #endif
 #ifdef DISABLE_BUSY_WAITING
-    disable_busy_waiting(true)
+    disable_busy_waiting(true),
 #else
-    disable_busy_waiting(false)
+    disable_busy_waiting(false),
 #endif
+  encode_threads(0),
+  max_pwm_bits(internal::Framebuffer::kDefaultBitPlanes),
+  skip_empty_planes(false),
+  merge_identical_planes(false),
+  brightness_at_output(false), huge_pages(false), spatial_dither(false),
+  pwm_dither_sequence(NULL), pwm_split_bits(0), scan_order(NULL),
+  uniformity_file(NULL)
 {
   // Nothing to see here.
 }
@@ -360,6 +407,17 @@ static void PrintOptions(const RGBMatrix::Options &o) {
   P_STR(panel_type);
   P_INT(limit_refresh_rate_hz);
   P_BOOL(disable_busy_waiting);
+  P_INT(encode_threads);
+  P_INT(max_pwm_bits);
+  P_BOOL(skip_empty_planes);
+  P_BOOL(merge_identical_planes);
+  P_BOOL(brightness_at_output);
+  P_BOOL(huge_pages);
+  P_BOOL(spatial_dither);
+  P_STR(pwm_dither_sequence);
+  P_INT(pwm_split_bits);
+  P_STR(scan_order);
+  P_STR(uniformity_file);
 #undef P_INT
 #undef P_STR
 #undef P_BOOL
@@ -367,8 +425,8 @@ static void PrintOptions(const RGBMatrix::Options &o) {
 #endif  // DEBUG_MATRIX_OPTIONS
 
 RGBMatrix::Impl::Impl(GPIO *io, const Options &options)
-  : params_(options), io_(NULL), updater_(NULL), shared_pixel_mapper_(NULL),
-    user_output_bits_(0) {
+  : params_(options), io_(NULL), updater_(NULL), encode_pool_(NULL),
+    frame_arena_(NULL), shared_pixel_mapper_(NULL), user_output_bits_(0) {
   assert(params_.Validate(NULL));
 #if DEBUG_MATRIX_OPTIONS
   PrintOptions(params_);
@@ -390,16 +448,64 @@ RGBMatrix::Impl::Impl(GPIO *io, const Options &options)
 
   Framebuffer::InitHardwareMapping(params_.hardware_mapping);
 
+  // The color tables of the uniformity correction profiles are created with
+  // each canvas, so are needed before the first.
+  UniformityCorrection uniformity;
+  if (params_.uniformity_file != NULL) {
+    std::string err;
+    if (!Framebuffer::LoadUniformityCorrection(
+          params_.uniformity_file, options.rows, options.cols,
+          params_.chain_length, params_.parallel, &uniformity, &err)) {
+      // Changed since validated; don't silently go on without correction.
+      fprintf(stderr, "%s", err.c_str());
+      abort();
+    }
+  }
+  Framebuffer::InitUniformityProfiles(uniformity.profiles);
+
+  frame_arena_ = new BufferArena(
+    Framebuffer::BitplaneBufferSize(params_.rows,
+                                    params_.cols * params_.chain_length,
+                                    params_.max_pwm_bits),
+    params_.huge_pages);
+
+  if (params_.encode_threads > 0) {
+    // Keep the encoding off the core the UpdateThread is running on.
+    const int cpus = std::min((int)sysconf(_SC_NPROCESSORS_ONLN), 32);
+    uint32_t affinity = 0;
+    for (int i = 0; i < cpus; ++i) {
+      if (i != 3 || cpus == 1) affinity |= (1u << i);
+    }
+    encode_pool_ = new EncodeWorkerPool(params_.encode_threads, affinity);
+  }
+
   active_ = CreateFrameCanvas();
-  active_->Clear();
+  active_->framebuffer()->SetDeferred(false);
   SetGPIO(io, true);
 
   // We need to apply the mapping for the panels first.
   ApplyPixelMapper(multiplex_mapper);
 
+  // Uniformity correction areas are in the coordinates of the chains, so
+  // assigned before other mappers arrange the panels; the designators carry
+  // their profile along.
+  for (size_t i = 0; i < uniformity.areas.size(); ++i) {
+    const UniformityCorrection::Area &area = uniformity.areas[i];
+    for (int y = area.y; y < area.y + area.height; ++y) {
+      for (int x = area.x; x < area.x + area.width; ++x) {
+        PixelDesignator *designator = shared_pixel_mapper_->get(x, y);
+        if (designator) designator->set_profile(area.profile);
+      }
+    }
+  }
+
   // .. followed by higher level mappers that might arrange panels.
   ApplyNamedPixelMappers(options.pixel_mapper_config,
                          params_.chain_length, params_.parallel);
+
+  // Clear after all mappers are applied, so that a possible staging buffer
+  // has its final size and is in a known state.
+  active_->Clear();
 }
 
 RGBMatrix::Impl::~Impl() {
@@ -416,7 +522,12 @@ RGBMatrix::Impl::~Impl() {
   for (size_t i = 0; i < created_frames_.size(); ++i) {
     delete created_frames_[i];
   }
+  for (size_t i = 0; i < released_frames_.size(); ++i) {
+    delete released_frames_[i];
+  }
+  delete frame_arena_;
   delete shared_pixel_mapper_;
+  delete encode_pool_;
 }
 
 RGBMatrix::~RGBMatrix() {
@@ -462,13 +573,50 @@ void RGBMatrix::Impl::ApplyNamedPixelMappers(const char *pixel_mapper_config,
   free(writeable_copy);
 }
 
+// The lowest bitplane shown in each refresh for temporal dithering; the
+// bitplanes up to the largest in the sequence are shown with the same,
+// shortest pulse. Without an explicit sequence, a ruler sequence for
+// "dither_bits": bitplane b is shown in every 2^(dither_bits - b)th
+// refresh, spread as evenly as possible, so that each counts half of the
+// next one, e.g. 0, 2, 1, 2 for two bits.
+static std::vector<uint8_t> CreateDitherSequence(int dither_bits,
+                                                 const char *sequence) {
+  std::vector<uint8_t> result;
+  if (sequence != NULL && *sequence) {
+    for (const char *s = sequence; *s; ++s) {
+      result.push_back(*s - '0');
+    }
+    return result;
+  }
+  for (int i = 0; i < (1 << dither_bits); ++i) {
+    // Bitplane b is shown if i is a multiple of 2^(dither_bits - b).
+    int trailing_zeros = 0;
+    while (trailing_zeros < dither_bits && (i & (1 << trailing_zeros)) == 0) {
+      ++trailing_zeros;
+    }
+    result.push_back(dither_bits - trailing_zeros);
+  }
+  return result;
+}
+
 void RGBMatrix::Impl::SetGPIO(GPIO *io, bool start_thread) {
   if (io != NULL && io_ == NULL) {
     io_ = io;
+    dither_sequence_ = CreateDitherSequence(params_.pwm_dither_bits,
+                                            params_.pwm_dither_sequence);
+    const int dither_bits = *std::max_element(dither_sequence_.begin(),
+                                              dither_sequence_.end());
     Framebuffer::InitGPIO(io_, params_.rows, params_.parallel,
                           !params_.disable_hardware_pulsing,
-                          params_.pwm_lsb_nanoseconds, params_.pwm_dither_bits,
-                          params_.row_address_type);
+                          params_.pwm_lsb_nanoseconds, dither_bits,
+                          params_.pwm_split_bits,
+                          params_.row_address_type, params_.max_pwm_bits,
+                          params_.skip_empty_planes,
+                          params_.merge_identical_planes);
+    if (params_.brightness_at_output) {
+      Framebuffer::SetOutputBrightness(params_.brightness,
+                                       do_luminance_correct_);
+    }
     Framebuffer::InitializePanels(io_, params_.panel_type,
                                   params_.cols * params_.chain_length);
   }
@@ -479,7 +627,16 @@ void RGBMatrix::Impl::SetGPIO(GPIO *io, bool start_thread) {
 
 bool RGBMatrix::Impl::StartRefresh() {
   if (updater_ == NULL && io_ != NULL) {
-    updater_ = new UpdateThread(io_, active_, params_.pwm_dither_bits,
+    if (params_.show_refresh_rate) {
+      // Shown with the refresh rate, to compare the effect of scan orders.
+      const Framebuffer *fb = active_->framebuffer();
+      printf("Row order:");
+      for (int i = 0; i < fb->double_rows(); ++i) {
+        printf("%s%d", i ? "," : " ", fb->row_order()[i]);
+      }
+      printf("\n");
+    }
+    updater_ = new UpdateThread(io_, active_, dither_sequence_,
                                 params_.show_refresh_rate,
                                 params_.limit_refresh_rate_hz,
                                 !params_.disable_busy_waiting);
@@ -496,14 +653,24 @@ bool RGBMatrix::Impl::StartRefresh() {
 }
 
 FrameCanvas *RGBMatrix::Impl::CreateFrameCanvas() {
-  FrameCanvas *result =
-    new FrameCanvas(new Framebuffer(params_.rows,
-                                    params_.cols * params_.chain_length,
-                                    params_.parallel,
-                                    params_.scan_mode,
-                                    params_.led_rgb_sequence,
-                                    params_.inverse_colors,
-                                    &shared_pixel_mapper_));
+  FrameCanvas *result;
+  const bool reused = !released_frames_.empty();
+  if (reused) {
+    result = released_frames_.back();
+    released_frames_.pop_back();
+    ++result->generation_;
+  } else {
+    result = new FrameCanvas(new Framebuffer(params_.rows,
+                                             params_.cols * params_.chain_length,
+                                             params_.parallel,
+                                             params_.scan_mode,
+                                             params_.scan_order,
+                                             params_.led_rgb_sequence,
+                                             params_.inverse_colors,
+                                             params_.max_pwm_bits,
+                                             frame_arena_,
+                                             &shared_pixel_mapper_));
+  }
   if (created_frames_.empty()) {
     // First time. Get defaults from initial Framebuffer.
     do_luminance_correct_ = result->framebuffer()->luminance_correct();
@@ -511,13 +678,27 @@ FrameCanvas *RGBMatrix::Impl::CreateFrameCanvas() {
 
   result->framebuffer()->SetPWMBits(params_.pwm_bits);
   result->framebuffer()->set_luminance_correct(do_luminance_correct_);
-  result->framebuffer()->SetBrightness(params_.brightness);
+  // With brightness applied at output, all is encoded at full brightness.
+  result->framebuffer()->SetBrightness(params_.brightness_at_output
+                                       ? 100 : params_.brightness);
+  result->framebuffer()->set_spatial_dither(params_.spatial_dither);
+  // With uniformity correction, moved pixels are set again, which needs
+  // their exact colors (see Framebuffer::Scroll()).
+  result->framebuffer()->set_rgb_shadow(params_.uniformity_file != NULL);
+  if (encode_pool_) {
+    // New canvases are off-screen; only encode when swapped in.
+    result->framebuffer()->EnableStaging(encode_pool_);
+    result->framebuffer()->SetDeferred(true);
+  }
+  if (reused || encode_pool_) {
+    result->framebuffer()->Clear();
+  }
 
   created_frames_.push_back(result);
 
   if (created_frames_.size() % 500 == 0) {
     if (created_frames_.size() == 500) {
-      fprintf(stderr, "CreateFrameCanvas() called %d times; Usually you only want to call it once (or at most a few times) for double-buffering. These frames will not be freed until the end of the program.\n"
+      fprintf(stderr, "CreateFrameCanvas() called %d times; Usually you only want to call it once (or at most a few times) for double-buffering. These frames will not be freed until the end of the program, unless handed back with ReleaseFrameCanvas().\n"
               "Typical reasons: \n"
               "  * Accidentally called CreateFrameCanvas() inside your inner loop (move outside the loop. Create offscreen-canvas once, then re-use. See SwapOnVSync() examples).\n"
               "  * Used to pre-compute many frames (use led_matrix::StreamWriter instead for such use-case. See e.g. led-image-viewer)\n",
@@ -531,12 +712,53 @@ FrameCanvas *RGBMatrix::Impl::CreateFrameCanvas() {
   return result;
 }
 
+bool RGBMatrix::Impl::ReleaseFrameCanvas(FrameCanvas *canvas) {
+  if (canvas == NULL || canvas == active_) return false;
+  std::vector<FrameCanvas*>::iterator it =
+    std::find(created_frames_.begin(), created_frames_.end(), canvas);
+  if (it == created_frames_.end()) return false;
+  created_frames_.erase(it);
+  released_frames_.push_back(canvas);
+  return true;
+}
+
 FrameCanvas *RGBMatrix::Impl::SwapOnVSync(FrameCanvas *other,
                                           unsigned frame_fraction) {
+  return SwapOrCrossfade(other, frame_fraction, 0);
+}
+
+FrameCanvas *RGBMatrix::Impl::CrossfadeOnVSync(FrameCanvas *other,
+                                               int duration_ms) {
+  if (other == NULL || other == active_) duration_ms = 0;
+  return SwapOrCrossfade(other, 1, duration_ms < 0 ? 0 : duration_ms * 1000);
+}
+
+FrameCanvas *RGBMatrix::Impl::SwapOrCrossfade(FrameCanvas *other,
+                                              unsigned frame_fraction,
+                                              uint32_t fade_usec) {
   if (frame_fraction == 0) frame_fraction = 1; // correct user error.
   if (!updater_) return NULL;
-  FrameCanvas *const previous = updater_->SwapOnVSync(other, frame_fraction);
+  // With deferred encoding, this is where the drawing is encoded; the
+  // canvas on screen then is drawn to directly.
+  if (other) {
+    other->framebuffer()->SetDeferred(false);
+    other->framebuffer()->FindIdenticalPlanes();
+  }
+  FrameCanvas *const previous = updater_->SwapOnVSync(other, frame_fraction,
+                                                      fade_usec);
   if (other) active_ = other;
+  if (encode_pool_ && previous != active_) {
+    previous->framebuffer()->SetDeferred(true);
+  }
+  return previous;
+}
+
+FrameCanvas *RGBMatrix::Impl::SwapOnVSyncIncremental(FrameCanvas *other,
+                                                     unsigned frame_fraction) {
+  FrameCanvas *const previous = SwapOnVSync(other, frame_fraction);
+  if (previous != NULL && other != NULL && previous != other) {
+    previous->framebuffer()->UpdateFrom(other->framebuffer());
+  }
   return previous;
 }
 
@@ -547,9 +769,8 @@ uint64_t RGBMatrix::Impl::AwaitInputChange(int timeout_ms) {
 
 bool RGBMatrix::Impl::SetPWMBits(uint8_t value) {
   const bool success = active_->framebuffer()->SetPWMBits(value);
-  if (success) {
-    params_.pwm_bits = value;
-  }
+  // Possibly limited to max_pwm_bits.
+  params_.pwm_bits = active_->framebuffer()->pwmbits();
   return success;
 }
 uint8_t RGBMatrix::Impl::pwmbits() { return params_.pwm_bits; }
@@ -558,12 +779,24 @@ uint8_t RGBMatrix::Impl::pwmbits() { return params_.pwm_bits; }
 void RGBMatrix::Impl::set_luminance_correct(bool on) {
   active_->framebuffer()->set_luminance_correct(on);
   do_luminance_correct_ = on;
+  if (params_.brightness_at_output && io_ != NULL) {
+    Framebuffer::SetOutputBrightness(params_.brightness, do_luminance_correct_);
+  }
 }
 bool RGBMatrix::Impl::luminance_correct() const {
   return do_luminance_correct_;
 }
 
 void RGBMatrix::Impl::SetBrightness(uint8_t brightness) {
+  if (params_.brightness_at_output) {
+    params_.brightness = (brightness <= 100
+                          ? (brightness != 0 ? brightness : 1) : 100);
+    if (io_ != NULL) {
+      Framebuffer::SetOutputBrightness(params_.brightness,
+                                       do_luminance_correct_);
+    }
+    return;
+  }
   for (size_t i = 0; i < created_frames_.size(); ++i) {
     created_frames_[i]->framebuffer()->SetBrightness(brightness);
   }
@@ -583,26 +816,82 @@ bool RGBMatrix::Impl::ApplyPixelMapper(const PixelMapper *mapper) {
   if (!mapper->GetSizeMapping(old_width, old_height, &new_width, &new_height)) {
     return false;
   }
-  PixelDesignatorMap *new_mapper = new PixelDesignatorMap(
-    new_width, new_height, shared_pixel_mapper_->GetFillColorBits());
-  for (int y = 0; y < new_height; ++y) {
-    for (int x = 0; x < new_width; ++x) {
-      int orig_x = -1, orig_y = -1;
-      mapper->MapVisibleToMatrix(old_width, old_height,
-                                 x, y, &orig_x, &orig_y);
-      if (orig_x < 0 || orig_y < 0 ||
-          orig_x >= old_width || orig_y >= old_height) {
-        fprintf(stderr, "Error in PixelMapper: (%d, %d) -> (%d, %d) [range: "
-                "%dx%d]\n", x, y, orig_x, orig_y, old_width, old_height);
-        continue;
+  const int old_copies = shared_pixel_mapper_->copies();
+  PixelDesignatorMap *new_mapper;
+  if (!mapper->MapsOneToMany()) {
+    new_mapper = new PixelDesignatorMap(
+      new_width, new_height, shared_pixel_mapper_->GetFillColorBits(),
+      old_copies);
+    for (int y = 0; y < new_height; ++y) {
+      for (int x = 0; x < new_width; ++x) {
+        int orig_x = -1, orig_y = -1;
+        mapper->MapVisibleToMatrix(old_width, old_height,
+                                   x, y, &orig_x, &orig_y);
+        if (orig_x < 0 || orig_y < 0 ||
+            orig_x >= old_width || orig_y >= old_height) {
+          fprintf(stderr, "Error in PixelMapper: (%d, %d) -> (%d, %d) "
+                  "[range: %dx%d]\n", x, y, orig_x, orig_y,
+                  old_width, old_height);
+          continue;
+        }
+        for (int copy = 0; copy < old_copies; ++copy) {
+          *new_mapper->get(x, y, copy)
+            = *shared_pixel_mapper_->get(orig_x, orig_y, copy);
+        }
+      }
+    }
+  } else {
+    // Each old pixel, with all its copies, goes to at most one new pixel;
+    // the new pixels need as many copies as the most of them get.
+    std::vector<int> target(old_width * old_height, -1);
+    std::vector<int> copies(new_width * new_height, 0);
+    int max_copies = 1;
+    for (int y = 0; y < old_height; ++y) {
+      for (int x = 0; x < old_width; ++x) {
+        int visible_x = -1, visible_y = -1;
+        if (!mapper->MapMatrixToVisible(old_width, old_height, x, y,
+                                        &visible_x, &visible_y)) {
+          continue;
+        }
+        if (visible_x < 0 || visible_y < 0 ||
+            visible_x >= new_width || visible_y >= new_height) {
+          fprintf(stderr, "Error in PixelMapper: (%d, %d) <- (%d, %d) "
+                  "[range: %dx%d]\n", visible_x, visible_y, x, y,
+                  new_width, new_height);
+          continue;
+        }
+        const int t = visible_y * new_width + visible_x;
+        target[y * old_width + x] = t;
+        for (int copy = 0; copy < old_copies; ++copy) {
+          if (shared_pixel_mapper_->get(x, y, copy)->gpio_word < 0) break;
+          max_copies = std::max(max_copies, ++copies[t]);
+        }
+      }
+    }
+    new_mapper = new PixelDesignatorMap(
+      new_width, new_height, shared_pixel_mapper_->GetFillColorBits(),
+      max_copies);
+    std::fill(copies.begin(), copies.end(), 0);
+    for (int y = 0; y < old_height; ++y) {
+      for (int x = 0; x < old_width; ++x) {
+        const int t = target[y * old_width + x];
+        if (t < 0) continue;
+        for (int copy = 0; copy < old_copies; ++copy) {
+          const internal::PixelDesignator *orig_designator
+            = shared_pixel_mapper_->get(x, y, copy);
+          if (orig_designator->gpio_word < 0) break;
+          *new_mapper->get(t % new_width, t / new_width, copies[t]++)
+            = *orig_designator;
+        }
       }
-      const internal::PixelDesignator *orig_designator;
-      orig_designator = shared_pixel_mapper_->get(orig_x, orig_y);
-      *new_mapper->get(x, y) = *orig_designator;
     }
   }
   delete shared_pixel_mapper_;
   shared_pixel_mapper_ = new_mapper;
+  // Staging buffers are in visible coordinates, which just changed.
+  for (size_t i = 0; i < created_frames_.size(); ++i) {
+    created_frames_[i]->framebuffer()->ResetStaging();
+  }
   return true;
 }
 
@@ -714,10 +1003,20 @@ RGBMatrix *RGBMatrix::CreateFromFlags(int *argc, char ***argv,
 FrameCanvas *RGBMatrix::CreateFrameCanvas() {
   return impl_->CreateFrameCanvas();
 }
+bool RGBMatrix::ReleaseFrameCanvas(FrameCanvas *canvas) {
+  return impl_->ReleaseFrameCanvas(canvas);
+}
 FrameCanvas *RGBMatrix::SwapOnVSync(FrameCanvas *other,
                                     unsigned framerate_fraction) {
   return impl_->SwapOnVSync(other, framerate_fraction);
 }
+FrameCanvas *RGBMatrix::SwapOnVSyncIncremental(FrameCanvas *other,
+                                               unsigned framerate_fraction) {
+  return impl_->SwapOnVSyncIncremental(other, framerate_fraction);
+}
+FrameCanvas *RGBMatrix::CrossfadeOnVSync(FrameCanvas *other, int duration_ms) {
+  return impl_->CrossfadeOnVSync(other, duration_ms);
+}
 bool RGBMatrix::ApplyPixelMapper(const PixelMapper *mapper) {
   return impl_->ApplyPixelMapper(mapper);
 }
@@ -797,6 +1096,9 @@ bool FrameCanvas::luminance_correct() const { return frame_->luminance_correct()
 void FrameCanvas::SetBrightness(uint8_t brightness) { frame_->SetBrightness(brightness); }
 uint8_t FrameCanvas::brightness() { return frame_->brightness(); }
 
+void FrameCanvas::set_spatial_dither(bool on) { frame_->set_spatial_dither(on); }
+bool FrameCanvas::spatial_dither() const { return frame_->spatial_dither(); }
+
 void FrameCanvas::Serialize(const char **data, size_t *len) const {
   frame_->Serialize(data, len);
 }
@@ -806,4 +1108,28 @@ bool FrameCanvas::Deserialize(const char *data, size_t len) {
 void FrameCanvas::CopyFrom(const FrameCanvas &other) {
   frame_->CopyFrom(other.frame_);
 }
+bool FrameCanvas::Pack() { return frame_->Pack(); }
+
+void FrameCanvas::SetPixelsToColor(const int *offsets, int count,
+                                   uint8_t red, uint8_t green, uint8_t blue) {
+  frame_->SetPixelsToColor(offsets, count, red, green, blue);
+}
+
+void FrameCanvas::Scroll(int dx, int dy) {
+  frame_->Scroll(dx, dy, 0, 0, frame_->width(), frame_->height());
+}
+void FrameCanvas::Scroll(int dx, int dy, int x, int y, int width, int height) {
+  frame_->Scroll(dx, dy, x, y, width, height);
+}
+
+void FrameCanvas::set_rgb_shadow(bool on) { frame_->set_rgb_shadow(on); }
+bool FrameCanvas::rgb_shadow() const { return frame_->rgb_shadow(); }
+void FrameCanvas::GetPixel(int x, int y,
+                           uint8_t *red, uint8_t *green, uint8_t *blue) {
+  frame_->GetPixel(x, y, red, green, blue);
+}
+void FrameCanvas::GetPixels(int x, int y, int width, int height,
+                            Color *colors) {
+  frame_->GetPixels(x, y, width, height, colors);
+}
 }  // end namespace rgb_matrix
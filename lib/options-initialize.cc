@@ -23,6 +23,7 @@
 #include <grp.h>
 #include <pwd.h>
 
+#include <algorithm>
 #include <vector>
 
 #include "multiplex-mappers-internal.h"
@@ -31,6 +32,9 @@
 #include "gpio.h"
 
 namespace rgb_matrix {
+// More threads than cores are of no use; this is plenty for any Pi.
+static constexpr int kMaxEncodeThreads = 16;
+
 RuntimeOptions::RuntimeOptions() :
 #ifdef RGB_SLOWDOWN_GPIO
   gpio_slowdown(RGB_SLOWDOWN_GPIO),
@@ -158,6 +162,15 @@ static bool FlagInit(int &argc, char **&argv,
       if (ConsumeStringFlag("panel-type", it, end,
                             &mopts->panel_type, &err))
         continue;
+      if (ConsumeStringFlag("pwm-dither-sequence", it, end,
+                            &mopts->pwm_dither_sequence, &err))
+        continue;
+      if (ConsumeStringFlag("scan-order", it, end,
+                            &mopts->scan_order, &err))
+        continue;
+      if (ConsumeStringFlag("uniformity-file", it, end,
+                            &mopts->uniformity_file, &err))
+        continue;
       if (ConsumeIntFlag("rows", it, end, &mopts->rows, &err))
         continue;
       if (ConsumeIntFlag("cols", it, end, &mopts->cols, &err))
@@ -174,22 +187,42 @@ static bool FlagInit(int &argc, char **&argv,
         continue;
       if (ConsumeIntFlag("pwm-bits", it, end, &mopts->pwm_bits, &err))
         continue;
+      if (ConsumeIntFlag("max-pwm-bits", it, end, &mopts->max_pwm_bits, &err))
+        continue;
       if (ConsumeIntFlag("pwm-lsb-nanoseconds", it, end,
                          &mopts->pwm_lsb_nanoseconds, &err))
         continue;
       if (ConsumeIntFlag("pwm-dither-bits", it, end,
                          &mopts->pwm_dither_bits, &err))
         continue;
+      if (ConsumeIntFlag("pwm-split-bits", it, end,
+                         &mopts->pwm_split_bits, &err))
+        continue;
       if (ConsumeIntFlag("row-addr-type", it, end,
                          &mopts->row_address_type, &err))
         continue;
       if (ConsumeIntFlag("limit-refresh", it, end,
                          &mopts->limit_refresh_rate_hz, &err))
         continue;
+      if (ConsumeIntFlag("encode-threads", it, end,
+                         &mopts->encode_threads, &err))
+        continue;
       if (ConsumeBoolFlag("show-refresh", it, &mopts->show_refresh_rate))
         continue;
       if (ConsumeBoolFlag("inverse", it, &mopts->inverse_colors))
         continue;
+      if (ConsumeBoolFlag("skip-empty-planes", it, &mopts->skip_empty_planes))
+        continue;
+      if (ConsumeBoolFlag("merge-identical-planes", it,
+                          &mopts->merge_identical_planes))
+        continue;
+      if (ConsumeBoolFlag("brightness-at-output", it,
+                          &mopts->brightness_at_output))
+        continue;
+      if (ConsumeBoolFlag("huge-pages", it, &mopts->huge_pages))
+        continue;
+      if (ConsumeBoolFlag("spatial-dither", it, &mopts->spatial_dither))
+        continue;
       // We don't have a swap_green_blue option anymore, but we simulate the
       // flag for a while.
       bool swap_green_blue;
@@ -327,9 +360,14 @@ void PrintMatrixFlags(FILE *out, const RGBMatrix::Options &d,
           "\t                            Optional params after a colon e.g. \"U-mapper;Rotate:90\"\n"
           "\t                            Available: %s. Default: \"\"\n"
           "\t--led-pwm-bits=<1..%d>    : PWM bits (Default: %d).\n"
-          "\t--led-brightness=<percent>: Brightness in percent (Default: %d).\n"
-          "\t--led-scan-mode=<0..1>    : 0 = progressive; 1 = interlaced "
+          "\t--led-max-pwm-bits=<1..%d>: Maximum PWM bits to allocate for "
           "(Default: %d).\n"
+          "\t--led-brightness=<percent>: Brightness in percent (Default: %d).\n"
+          "\t--led-%sbrightness-at-output : %spply brightness when showing, not when drawing.\n"
+          "\t--led-scan-mode=<0..2>    : 0 = progressive; 1 = interlaced; "
+          "2 = bit-reversed (Default: %d).\n"
+          "\t--led-scan-order=<order>  : \"stride:<n>\" or comma separated list of rows;\n"
+          "\t                            overrides --led-scan-mode.\n"
           "\t--led-row-addr-type=<0..4>: 0 = default; 1 = AB-addressed panels; 2 = direct row select; 3 = ABC-addressed panels; 4 = ABC Shift + DE direct "
           "(Default: 0).\n"
           "\t--led-%sshow-refresh        : %show refresh rate.\n"
@@ -341,25 +379,52 @@ void PrintMatrixFlags(FILE *out, const RGBMatrix::Options &d,
           "swapped (Default: \"RGB\")\n"
           "\t--led-pwm-lsb-nanoseconds : PWM Nanoseconds for LSB "
           "(Default: %d)\n"
-          "\t--led-pwm-dither-bits=<0..2> : Time dithering of lower bits "
+          "\t--led-pwm-dither-bits=<0..%d> : Time dithering of lower bits "
           "(Default: 0)\n"
+          "\t--led-pwm-dither-sequence=<digits> : Lowest bitplane shown in each refresh,\n"
+          "\t                            e.g. \"0212\"; implies --led-pwm-dither-bits.\n"
+          "\t--led-pwm-split-bits=<0..%d> : Show the longest bitplanes in 2^n pulses\n"
+          "\t                            spread over the refresh; less flicker (Default: 0)\n"
+          "\t--led-%sspatial-dither     : %sither the bits below --led-pwm-bits spatially.\n"
           "\t--led-%shardware-pulse   : %sse hardware pin-pulse generation.\n"
           "\t--led-panel-type=<name>   : Needed to initialize special panels. Supported: 'FM6126A', 'FM6127'\n"
-          "\t--led-%sbusy-waiting     : %sse busy waiting when limiting refresh rate.\n",
+          "\t--led-uniformity-file=<file> : Color gains per panel or pixel to even out\n"
+          "\t                            panels that differ in brightness or white point.\n"
+          "\t--led-%sbusy-waiting     : %sse busy waiting when limiting refresh rate.\n"
+          "\t--led-encode-threads=<0..%d>: Draw off-screen canvases as RGB, encode with\n"
+          "\t                            this many threads on swap. 0=off. Default: %d\n"
+          "\t--led-%sskip-empty-planes  : %skip clocking out dark bitplanes of rows; less\n"
+          "\t                            time spent with dark content.\n"
+          "\t--led-%smerge-identical-planes : %show bitplanes with the same content in one\n"
+          "\t                            go; faster refresh with flat colors.\n"
+          "\t--led-%shuge-pages        : %sse huge pages for the canvas memory.\n",
           d.hardware_mapping,
           d.rows, d.cols, d.chain_length, d.parallel,
           (int) muxers.size(), CreateAvailableMultiplexString(muxers).c_str(),
           available_mappers.c_str(),
-          internal::Framebuffer::kBitPlanes, d.pwm_bits,
-          d.brightness, d.scan_mode,
+          d.max_pwm_bits, d.pwm_bits,
+          internal::Framebuffer::kMaxBitPlanes, d.max_pwm_bits,
+          d.brightness,
+          d.brightness_at_output ? "no-" : "",
+          d.brightness_at_output ? "Don't a" : "A",
+          d.scan_mode,
           d.show_refresh_rate ? "no-" : "", d.show_refresh_rate ? "Don't s" : "S",
           d.limit_refresh_rate_hz,
           d.inverse_colors ? "no-" : "",    d.inverse_colors ? "off" : "on",
           d.pwm_lsb_nanoseconds,
+          internal::Framebuffer::kMaxBitPlanes - 1,
+          internal::Framebuffer::kMaxSplitBits,
+          d.spatial_dither ? "no-" : "", d.spatial_dither ? "Don't d" : "D",
           !d.disable_hardware_pulsing ? "no-" : "",
           !d.disable_hardware_pulsing ? "Don't u" : "U",
           !d.disable_busy_waiting ? "no-" : "",
-          !d.disable_busy_waiting ? "Don't u" : "U");
+          !d.disable_busy_waiting ? "Don't u" : "U",
+          kMaxEncodeThreads, d.encode_threads,
+          d.skip_empty_planes ? "no-" : "",
+          d.skip_empty_planes ? "Don't s" : "S",
+          d.merge_identical_planes ? "no-" : "",
+          d.merge_identical_planes ? "Don't s" : "S",
+          d.huge_pages ? "no-" : "", d.huge_pages ? "Don't u" : "U");
 
   fprintf(out,
           "\t--led-slowdown-gpio=<%d..4>: "
@@ -443,27 +508,109 @@ bool RGBMatrix::Options::Validate(std::string *err_in) const {
     success = false;
   }
 
-  if (pwm_bits <= 0 || pwm_bits > internal::Framebuffer::kBitPlanes) {
+  if (max_pwm_bits <= 0 || max_pwm_bits > internal::Framebuffer::kMaxBitPlanes) {
+    char buffer[256];
+    snprintf(buffer, sizeof(buffer),
+             "Invalid range of max-pwm-bits (1..%d allowed).\n",
+             internal::Framebuffer::kMaxBitPlanes);
+    err->append(buffer);
+    success = false;
+  }
+
+  if (pwm_bits <= 0 || pwm_bits > internal::Framebuffer::kMaxBitPlanes) {
     char buffer[256];
     snprintf(buffer, sizeof(buffer),
              "Invalid range of pwm-bits (1..%d allowed).\n",
-             internal::Framebuffer::kBitPlanes);
+             internal::Framebuffer::kMaxBitPlanes);
+    err->append(buffer);
+    success = false;
+  } else if (max_pwm_bits > 0 && pwm_bits > max_pwm_bits) {
+    char buffer[256];
+    snprintf(buffer, sizeof(buffer),
+             "pwm-bits (%d) can't be larger than max-pwm-bits (%d).\n",
+             pwm_bits, max_pwm_bits);
     err->append(buffer);
     success = false;
   }
 
-  if (scan_mode < 0 || scan_mode > 1) {
-    err->append("Invalid scan mode (0 or 1 allowed).\n");
+  if (scan_mode < 0 || scan_mode > 2) {
+    err->append("Invalid scan mode (0..2 allowed).\n");
     success = false;
   }
 
+  if (rows >= 8 && rows <= 64 && rows % 2 == 0) {
+    std::vector<uint8_t> row_order;
+    if (!internal::Framebuffer::CreateRowOrder(rows, scan_mode, scan_order,
+                                               &row_order, err)) {
+      success = false;
+    } else if (row_address_type == 5 && (scan_mode == 2 || scan_order)
+               && !std::is_sorted(row_order.begin(), row_order.end())) {
+      // The B707 shift register can only advance to the next row. The
+      // interlaced scan mode always was accepted, so still is.
+      err->append("row-addr-type 5 doesn't support bit-reversed scan or "
+                  "scan-order.\n");
+      success = false;
+    }
+  }
+
   if (pwm_lsb_nanoseconds < 50 || pwm_lsb_nanoseconds > 3000) {
     err->append("Invalid range of pwm-lsb-nanoseconds (50..3000 allowed).\n");
     success = false;
   }
 
-  if (pwm_dither_bits < 0 || pwm_dither_bits > 2) {
-    err->append("Inavlid range of pwm-dither-bits (0..2 allowed).\n");
+  if (pwm_dither_bits < 0
+      || pwm_dither_bits >= internal::Framebuffer::kMaxBitPlanes) {
+    char buffer[256];
+    snprintf(buffer, sizeof(buffer),
+             "Invalid range of pwm-dither-bits (0..%d allowed).\n",
+             internal::Framebuffer::kMaxBitPlanes - 1);
+    err->append(buffer);
+    success = false;
+  }
+
+  if (pwm_dither_sequence != NULL) {
+    int largest = -1;
+    for (const char *s = pwm_dither_sequence; *s; ++s) {
+      if (*s < '0' || *s > '9') {
+        largest = -1;
+        break;
+      }
+      largest = std::max(largest, *s - '0');
+    }
+    if (largest < 0) {
+      err->append("pwm-dither-sequence needs to be a sequence of digits "
+                  "0..9, the lowest bitplane shown in each refresh.\n");
+      success = false;
+    } else if (largest >= pwm_bits) {
+      char buffer[256];
+      snprintf(buffer, sizeof(buffer),
+               "Invalid range of pwm-dither-sequence digits (0..%d allowed "
+               "with pwm-bits %d).\n", pwm_bits - 1, pwm_bits);
+      err->append(buffer);
+      success = false;
+    } else if (pwm_dither_bits != 0 && pwm_dither_bits != largest) {
+      err->append("pwm-dither-bits doesn't match the largest bitplane in "
+                  "pwm-dither-sequence (it is implied by it).\n");
+      success = false;
+    }
+  }
+
+  if (pwm_split_bits < 0
+      || pwm_split_bits > internal::Framebuffer::kMaxSplitBits) {
+    char buffer[256];
+    snprintf(buffer, sizeof(buffer),
+             "Invalid range of pwm-split-bits (0..%d allowed).\n",
+             internal::Framebuffer::kMaxSplitBits);
+    err->append(buffer);
+    success = false;
+  }
+
+  if (encode_threads < 0 || encode_threads > kMaxEncodeThreads) {
+    char buffer[256];
+    snprintf(buffer, sizeof(buffer),
+             "Invalid range of encode-threads (0..%d allowed).\n",
+             kMaxEncodeThreads);
+    err->append(buffer);
     success = false;
   }
 
@@ -480,6 +627,16 @@ bool RGBMatrix::Options::Validate(std::string *err_in) const {
     }
   }
 
+  // Only checked against a valid panel arrangement.
+  if (uniformity_file != NULL && success) {
+    internal::UniformityCorrection correction;
+    if (!internal::Framebuffer::LoadUniformityCorrection(
+          uniformity_file, rows, cols, chain_length, parallel,
+          &correction, err)) {
+      success = false;
+    }
+  }
+
   if (!success && !err_in) {
     // If we didn't get a string to write to, we write things to stderr.
     fprintf(stderr, "%s", err->c_str());
@@ -0,0 +1,209 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//
+// Rendering of the PaletteCanvas. Pixels with a changed index are rendered
+// as row spans; for changed palette entries, the pixels using them are
+// found in a list sorted by index and set in one go per entry.
+
+#include "palette-canvas.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#include "led-matrix.h"
+
+namespace rgb_matrix {
+namespace {
+inline bool SameColor(const Color &a, const Color &b) {
+  return a.r == b.r && a.g == b.g && a.b == b.b;
+}
+}  // anonymous namespace
+
+PaletteCanvas::PaletteCanvas(int width, int height)
+  : width_(width), height_(height), indices_(width * height, 0),
+    any_dirty_(false), pixels_by_index_valid_(false), row_(width) {
+  const Span empty = { width, 0 };
+  dirty_.resize(height, empty);
+}
+
+void PaletteCanvas::SetPixel(int x, int y, uint8_t index) {
+  if (x < 0 || x >= width_ || y < 0 || y >= height_) return;
+  uint8_t &pixel = indices_[y * width_ + x];
+  if (pixel == index) return;
+  pixel = index;
+  MarkDirty(x, y, 1, 1);
+}
+
+uint8_t PaletteCanvas::GetPixel(int x, int y) const {
+  if (x < 0 || x >= width_ || y < 0 || y >= height_) return 0;
+  return indices_[y * width_ + x];
+}
+
+void PaletteCanvas::SetPixels(int x, int y, int width, int height,
+                              const uint8_t *indices) {
+  const int x_start = std::max(x, 0);
+  const int x_end = std::min(x + width, width_);
+  const int y_start = std::max(y, 0);
+  const int y_end = std::min(y + height, height_);
+  if (x_start >= x_end || y_start >= y_end) return;
+  for (int row = y_start; row < y_end; ++row) {
+    memcpy(&indices_[row * width_ + x_start],
+           indices + (row - y) * width + (x_start - x), x_end - x_start);
+  }
+  MarkDirty(x_start, y_start, x_end - x_start, y_end - y_start);
+}
+
+void PaletteCanvas::Fill(uint8_t index) {
+  std::fill(indices_.begin(), indices_.end(), index);
+  MarkDirty(0, 0, width_, height_);
+}
+
+void PaletteCanvas::SetColor(uint8_t index,
+                             uint8_t red, uint8_t green, uint8_t blue) {
+  const Color color(red, green, blue);
+  if (SameColor(palette_[index], color)) return;
+  palette_[index] = color;
+  changed_colors_.set(index);
+}
+
+void PaletteCanvas::CycleColors(uint8_t first, uint8_t last, int steps) {
+  if (first >= last) return;
+  const int count = last - first + 1;
+  const int shift = ((steps % count) + count) % count;
+  if (shift == 0) return;
+  Color before[256];
+  std::copy(palette_ + first, palette_ + last + 1, before);
+  std::rotate(palette_ + first, palette_ + first + count - shift,
+              palette_ + last + 1);
+  for (int i = 0; i < count; ++i) {
+    if (!SameColor(before[i], palette_[first + i])) {
+      changed_colors_.set(first + i);
+    }
+  }
+}
+
+void PaletteCanvas::ForgetCanvas(FrameCanvas *canvas) {
+  pending_.erase(canvas);
+}
+
+void PaletteCanvas::MarkDirty(int x, int y, int width, int height) {
+  for (int row = y; row < y + height; ++row) {
+    Span &span = dirty_[row];
+    span.x0 = std::min(span.x0, x);
+    span.x1 = std::max(span.x1, x + width);
+  }
+  any_dirty_ = true;
+  pixels_by_index_valid_ = false;
+}
+
+void PaletteCanvas::UpdatePixelsByIndex() {
+  if (pixels_by_index_valid_) return;
+  // Counting sort.
+  int counts[256] = {0};
+  for (size_t i = 0; i < indices_.size(); ++i) {
+    ++counts[indices_[i]];
+  }
+  int position[256];
+  index_start_[0] = 0;
+  for (int i = 0; i < 256; ++i) {
+    position[i] = index_start_[i];
+    index_start_[i + 1] = index_start_[i] + counts[i];
+  }
+  pixels_by_index_.resize(indices_.size());
+  for (size_t i = 0; i < indices_.size(); ++i) {
+    pixels_by_index_[position[indices_[i]]++] = i;
+  }
+  pixels_by_index_valid_ = true;
+}
+
+int PaletteCanvas::ToCanvasOffsets(const FrameCanvas *canvas,
+                                   const int *offsets, int count) {
+  const int canvas_width = canvas->width();
+  canvas_offsets_.clear();
+  for (int i = 0; i < count; ++i) {
+    const int x = offsets[i] % width_;
+    const int y = offsets[i] / width_;
+    if (x >= canvas_width) continue;  // SetPixelsToColor() skips rows below.
+    canvas_offsets_.push_back(y * canvas_width + x);
+  }
+  return canvas_offsets_.size();
+}
+
+void PaletteCanvas::RenderSpan(FrameCanvas *canvas, int y, int x0, int x1) {
+  const uint8_t *index = &indices_[y * width_ + x0];
+  for (int x = x0; x < x1; ++x, ++index) {
+    row_[x - x0] = palette_[*index];
+  }
+  canvas->SetPixels(x0, y, x1 - x0, 1, &row_[0]);
+}
+
+void PaletteCanvas::Render(FrameCanvas *canvas) {
+  // Hand the changes to all canvases we know of.
+  if (any_dirty_ || changed_colors_.any()) {
+    for (std::map<FrameCanvas*, Pending>::iterator it = pending_.begin();
+         it != pending_.end(); ++it) {
+      Pending &pending = it->second;
+      pending.colors |= changed_colors_;
+      if (!any_dirty_) continue;
+      for (int y = 0; y < height_; ++y) {
+        pending.rows[y].x0 = std::min(pending.rows[y].x0, dirty_[y].x0);
+        pending.rows[y].x1 = std::max(pending.rows[y].x1, dirty_[y].x1);
+      }
+    }
+    const Span empty = { width_, 0 };
+    std::fill(dirty_.begin(), dirty_.end(), empty);
+    changed_colors_.reset();
+    any_dirty_ = false;
+  }
+
+  // A canvas seen for the first time, or released and created again since,
+  // needs everything.
+  std::map<FrameCanvas*, Pending>::iterator target = pending_.find(canvas);
+  if (target == pending_.end()) {
+    target = pending_.insert(std::make_pair(canvas, Pending())).first;
+  }
+  Pending &pending = target->second;
+  if (pending.rows.empty() || pending.generation != canvas->generation()) {
+    const Span all = { 0, width_ };
+    pending.generation = canvas->generation();
+    pending.rows.assign(height_, all);
+    pending.colors.reset();
+  }
+
+  if (pending.colors.any()) {
+    UpdatePixelsByIndex();
+    int count = 0;
+    for (int i = 0; i < 256; ++i) {
+      if (pending.colors[i]) count += index_start_[i + 1] - index_start_[i];
+    }
+    if (count > width_ * height_ / 8) {
+      // Setting pixels one by one is only worth it for a smaller part of
+      // the canvas; otherwise rows are a lot faster.
+      const Span all = { 0, width_ };
+      std::fill(pending.rows.begin(), pending.rows.end(), all);
+    } else {
+      for (int i = 0; i < 256; ++i) {
+        if (!pending.colors[i]) continue;
+        const Color &c = palette_[i];
+        const int *offsets = &pixels_by_index_[index_start_[i]];
+        int offset_count = index_start_[i + 1] - index_start_[i];
+        if (canvas->width() != width_) {
+          offset_count = ToCanvasOffsets(canvas, offsets, offset_count);
+          offsets = canvas_offsets_.data();
+        }
+        canvas->SetPixelsToColor(offsets, offset_count, c.r, c.g, c.b);
+      }
+    }
+    pending.colors.reset();
+  }
+
+  for (int y = 0; y < height_; ++y) {
+    Span &span = pending.rows[y];
+    if (span.x0 >= span.x1) continue;
+    RenderSpan(canvas, y, span.x0, span.x1);
+    span.x0 = width_;
+    span.x1 = 0;
+  }
+}
+
+}  // namespace rgb_matrix
@@ -283,6 +283,133 @@ private:
   int parallel_;
 };
 
+// Show the same content several times, e.g. on both faces of a double-sided
+// sign chained one after the other. The matrix is split into "count" equal
+// parts side by side, or stacked with a 'V' after the count ("Clone:2V"),
+// and each shows the whole visible canvas.
+class CloneMapper : public PixelMapper {
+public:
+  CloneMapper() : count_(2), vertical_(false) {}
+
+  virtual const char *GetName() const { return "Clone"; }
+
+  virtual bool SetParameters(int chain, int parallel, const char *param) {
+    count_ = 2;
+    vertical_ = false;
+    if (param == NULL || strlen(param) == 0) return true;
+    char *errpos;
+    const int count = strtol(param, &errpos, 10);
+    if (errpos != param && (*errpos == 'V' || *errpos == 'v')) {
+      vertical_ = true;
+      ++errpos;
+    }
+    if (errpos == param || *errpos != '\0' || count < 1) {
+      fprintf(stderr, "Clone parameter should be the number of copies, "
+              "optionally followed by 'V' to stack them, e.g. '2V'\n");
+      return false;
+    }
+    count_ = count;
+    return true;
+  }
+
+  virtual bool GetSizeMapping(int matrix_width, int matrix_height,
+                              int *visible_width, int *visible_height)
+    const {
+    const int split = vertical_ ? matrix_height : matrix_width;
+    if (split % count_ != 0) {
+      fprintf(stderr, "%s: the matrix %s %d is not divisible by %d\n",
+              GetName(), vertical_ ? "height" : "width", split, count_);
+      return false;
+    }
+    *visible_width = vertical_ ? matrix_width : matrix_width / count_;
+    *visible_height = vertical_ ? matrix_height / count_ : matrix_height;
+    return true;
+  }
+
+  virtual void MapVisibleToMatrix(int matrix_width, int matrix_height,
+                                  int x, int y,
+                                  int *matrix_x, int *matrix_y) const {
+    *matrix_x = x;  // The first copy.
+    *matrix_y = y;
+  }
+
+  virtual bool MapsOneToMany() const { return true; }
+
+  virtual bool MapMatrixToVisible(int matrix_width, int matrix_height,
+                                  int x, int y,
+                                  int *visible_x, int *visible_y) const {
+    if (vertical_) {
+      *visible_x = x;
+      *visible_y = y % (matrix_height / count_);
+    } else {
+      *visible_x = x % (matrix_width / count_);
+      *visible_y = y;
+    }
+    return true;
+  }
+
+private:
+  int count_;
+  bool vertical_;
+};
+
+// Show the canvas at a lower resolution: each visible pixel is a "factor" x
+// "factor" block of matrix pixels. Apps draw and encode a quarter of the
+// pixels with a factor of 2.
+class ScaleMapper : public PixelMapper {
+public:
+  ScaleMapper() : factor_(2) {}
+
+  virtual const char *GetName() const { return "Scale"; }
+
+  virtual bool SetParameters(int chain, int parallel, const char *param) {
+    if (param == NULL || strlen(param) == 0) {
+      factor_ = 2;
+      return true;
+    }
+    char *errpos;
+    const int factor = strtol(param, &errpos, 10);
+    if (*errpos != '\0' || factor < 1) {
+      fprintf(stderr, "Invalid scale parameter '%s'\n", param);
+      return false;
+    }
+    factor_ = factor;
+    return true;
+  }
+
+  virtual bool GetSizeMapping(int matrix_width, int matrix_height,
+                              int *visible_width, int *visible_height)
+    const {
+    if (matrix_width % factor_ != 0 || matrix_height % factor_ != 0) {
+      fprintf(stderr, "%s: the matrix %dx%d is not divisible by %d\n",
+              GetName(), matrix_width, matrix_height, factor_);
+      return false;
+    }
+    *visible_width = matrix_width / factor_;
+    *visible_height = matrix_height / factor_;
+    return true;
+  }
+
+  virtual void MapVisibleToMatrix(int matrix_width, int matrix_height,
+                                  int x, int y,
+                                  int *matrix_x, int *matrix_y) const {
+    *matrix_x = x * factor_;  // Top left of the block.
+    *matrix_y = y * factor_;
+  }
+
+  virtual bool MapsOneToMany() const { return true; }
+
+  virtual bool MapMatrixToVisible(int matrix_width, int matrix_height,
+                                  int x, int y,
+                                  int *visible_x, int *visible_y) const {
+    *visible_x = x / factor_;
+    *visible_y = y / factor_;
+    return true;
+  }
+
+private:
+  int factor_;
+};
 
 typedef std::map<std::string, PixelMapper*> MapperByName;
 static void RegisterPixelMapperInternal(MapperByName *registry,
@@ -302,6 +429,8 @@ static MapperByName *CreateMapperMap() {
   RegisterPixelMapperInternal(result, new UArrangementMapper());
   RegisterPixelMapperInternal(result, new VerticalMapper());
   RegisterPixelMapperInternal(result, new MirrorPixelMapper());
+  RegisterPixelMapperInternal(result, new CloneMapper());
+  RegisterPixelMapperInternal(result, new ScaleMapper());
   return result;
 }
 